@@ -0,0 +1,287 @@
+#include <benchmark/benchmark.h>
+
+#include <fstream>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../include/c011apsy.hpp"
+#include "../sample/bmp.inl"
+
+// the benchmarks are run as
+//     c011apsy_bench --benchmark_out=results.json --benchmark_out_format=json
+// so the results could be compared between the builds, e.g. with benchmark's tools/compare.py
+
+namespace c011apsy
+{
+    /*
+    * The access to the Wave internals, see the friend declaration in Wave
+    */
+    struct WaveBenchmark
+    {
+        template<class W>
+        static size_t filterCandidates( W& wave, size_t id )
+        {
+            return wave.filterCandidates( id );
+        }
+
+        template<class W>
+        static size_t getCollapsePoint( W& wave )
+        {
+            return wave.getCollapsePoint();
+        }
+    };
+}
+
+using namespace c011apsy;
+
+namespace
+{
+    using ColorWave = Wave<Color>;
+
+    const char* const Images[] = { "pipes.bmp", "maze.bmp" };
+
+    struct Pattern
+    {
+        std::vector<Color> pixels;
+        uint32_t width = 0;
+        uint32_t height = 0;
+    };
+
+    const Pattern& loadPattern( size_t image )
+    {
+        static std::map<size_t, Pattern> cache;
+        auto it = cache.find( image );
+        if ( it == cache.end() )
+        {
+            Pattern pattern;
+            pattern.pixels = readBMP( std::string( C011APSY_IMG_DIR ) + "/" + Images[image], pattern.width, pattern.height );
+            it = cache.emplace( image, std::move( pattern ) ).first;
+        }
+        return it->second;
+    }
+
+    ColorWave::RuleSetPtr loadRules( size_t image, size_t tileSize )
+    {
+        static std::map<std::pair<size_t, size_t>, ColorWave::RuleSetPtr> cache;
+        auto& rules = cache[{ image, tileSize }];
+        if ( !rules )
+        {
+            const Pattern& pattern = loadPattern( image );
+            rules = std::make_shared<const ColorWave::RuleSet>( pattern.pixels, pattern.width, pattern.height, tileSize, tileSize );
+        }
+        return rules;
+    }
+
+    /*
+    * A wave with some of the cells solved, so the field has all kinds of the cells
+    */
+    bool prepareWave( ColorWave& wave, size_t steps )
+    {
+        for ( size_t i = 0; i < steps; ++i )
+        {
+            if ( wave.collapse( true ) )
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    template<class B>
+    void fillRandom( B& bitset, size_t bits, uint64_t seed )
+    {
+        std::mt19937_64 mt( seed );
+        for ( size_t i = 0; i < bits; ++i )
+        {
+            bitset.set( i, (mt() & 1) != 0 );
+        }
+    }
+
+    // raw bitset operations, the fixed size flavors are unrolled by the compiler
+
+    template<class B>
+    void BM_BitsetIntersectCount( benchmark::State& state )
+    {
+        const size_t bits = static_cast<size_t>( state.range( 0 ) );
+        B a( bits );
+        B b( bits );
+        fillRandom( a, bits, 1 );
+        fillRandom( b, bits, 2 );
+
+        for ( auto _ : state )
+        {
+            benchmark::DoNotOptimize( a.intersectCount( b ) );
+            benchmark::ClobberMemory();
+        }
+        state.SetBytesProcessed( state.iterations() * static_cast<int64_t>( detail::wordCount( bits ) * sizeof( uint64_t ) * 2 ) );
+    }
+
+    template<class B>
+    void BM_BitsetAdd( benchmark::State& state )
+    {
+        const size_t bits = static_cast<size_t>( state.range( 0 ) );
+        B a( bits );
+        B b( bits );
+        fillRandom( b, bits, 2 );
+
+        for ( auto _ : state )
+        {
+            a.add( b );
+            benchmark::ClobberMemory();
+        }
+        state.SetBytesProcessed( state.iterations() * static_cast<int64_t>( detail::wordCount( bits ) * sizeof( uint64_t ) * 2 ) );
+    }
+
+    template<class B>
+    void BM_BitsetCount( benchmark::State& state )
+    {
+        const size_t bits = static_cast<size_t>( state.range( 0 ) );
+        B a( bits );
+        fillRandom( a, bits, 1 );
+
+        for ( auto _ : state )
+        {
+            benchmark::DoNotOptimize( a.count() );
+        }
+        state.SetBytesProcessed( state.iterations() * static_cast<int64_t>( detail::wordCount( bits ) * sizeof( uint64_t ) ) );
+    }
+
+    template<class B>
+    void BM_BitsetForEach( benchmark::State& state )
+    {
+        const size_t bits = static_cast<size_t>( state.range( 0 ) );
+        B a( bits );
+        fillRandom( a, bits, 1 );
+
+        for ( auto _ : state )
+        {
+            size_t sum = 0;
+            a.forEach( [&]( size_t i ) { sum += i; } );
+            benchmark::DoNotOptimize( sum );
+        }
+        state.SetItemsProcessed( state.iterations() * static_cast<int64_t>( a.count() ) );
+    }
+
+    BENCHMARK_TEMPLATE( BM_BitsetIntersectCount, Bitset )->RangeMultiplier( 8 )->Range( 64, 4096 );
+    BENCHMARK_TEMPLATE( BM_BitsetIntersectCount, FixedBitset<2> )->Arg( 128 );
+    BENCHMARK_TEMPLATE( BM_BitsetIntersectCount, FixedBitset<8> )->Arg( 512 );
+    BENCHMARK_TEMPLATE( BM_BitsetAdd, Bitset )->RangeMultiplier( 8 )->Range( 64, 4096 );
+    BENCHMARK_TEMPLATE( BM_BitsetAdd, FixedBitset<8> )->Arg( 512 );
+    BENCHMARK_TEMPLATE( BM_BitsetCount, Bitset )->RangeMultiplier( 8 )->Range( 64, 4096 );
+    BENCHMARK_TEMPLATE( BM_BitsetForEach, Bitset )->RangeMultiplier( 8 )->Range( 64, 4096 );
+
+    // the solver internals: args are the image and the tile size
+
+    void BM_FilterCandidates( benchmark::State& state )
+    {
+        const size_t image = static_cast<size_t>( state.range( 0 ) );
+        ColorWave wave( 64, 64, loadRules( image, static_cast<size_t>( state.range( 1 ) ) ), 1 );
+        prepareWave( wave, 256 );
+
+        std::vector<size_t> cells;
+        for ( size_t id = 0; id < wave.getField().size(); ++id )
+        {
+            if ( wave.getField()[id].count() > 1 )
+            {
+                cells.push_back( id );
+            }
+        }
+        if ( cells.empty() )
+        {
+            state.SkipWithError( "the wave is solved before the measurement" );
+            return;
+        }
+
+        size_t next = 0;
+        for ( auto _ : state )
+        {
+            // the cells are only narrowed down, so after the first pass every call does the same work
+            benchmark::DoNotOptimize( WaveBenchmark::filterCandidates( wave, cells[next] ) );
+            next = next + 1 < cells.size() ? next + 1 : 0;
+        }
+        state.SetItemsProcessed( state.iterations() );
+        state.SetLabel( std::string( Images[image] ) + ", " + std::to_string( wave.getTiles().size() ) + " tiles" );
+    }
+
+    void BM_GetCollapsePoint( benchmark::State& state )
+    {
+        const size_t image = static_cast<size_t>( state.range( 0 ) );
+        ColorWave wave( 256, 256, loadRules( image, static_cast<size_t>( state.range( 1 ) ) ), 1 );
+        if ( !prepareWave( wave, 1024 ) )
+        {
+            state.SkipWithError( "the wave is solved before the measurement" );
+            return;
+        }
+
+        for ( auto _ : state )
+        {
+            benchmark::DoNotOptimize( WaveBenchmark::getCollapsePoint( wave ) );
+        }
+        state.SetItemsProcessed( state.iterations() );
+        state.SetLabel( Images[image] );
+    }
+
+    BENCHMARK( BM_FilterCandidates )->ArgNames( { "image", "tile" } )->Args( { 0, 3 } )->Args( { 0, 4 } )->Args( { 1, 3 } );
+    BENCHMARK( BM_GetCollapsePoint )->ArgNames( { "image", "tile" } )->Args( { 0, 3 } )->Args( { 1, 3 } );
+
+    // pattern processing: args are the image and the tile size
+
+    void BM_Init( benchmark::State& state )
+    {
+        const size_t image = static_cast<size_t>( state.range( 0 ) );
+        const size_t tileSize = static_cast<size_t>( state.range( 1 ) );
+        const Pattern& pattern = loadPattern( image );
+
+        size_t tiles = 0;
+        for ( auto _ : state )
+        {
+            ColorWave::RuleSet rules( pattern.pixels, pattern.width, pattern.height, tileSize, tileSize );
+            tiles = rules.size();
+            benchmark::DoNotOptimize( tiles );
+        }
+        state.counters["tiles"] = static_cast<double>( tiles );
+        state.SetLabel( Images[image] );
+    }
+
+    BENCHMARK( BM_Init )->ArgNames( { "image", "tile" } )
+        ->Args( { 0, 2 } )->Args( { 0, 3 } )->Args( { 0, 4 } )->Args( { 0, 8 } )
+        ->Args( { 1, 2 } )->Args( { 1, 3 } )->Args( { 1, 4 } )
+        ->Unit( benchmark::kMicrosecond );
+
+    // the whole generation: args are the image, the field size and the propagation method
+
+    void BM_Collapse( benchmark::State& state )
+    {
+        const size_t image = static_cast<size_t>( state.range( 0 ) );
+        const size_t size = static_cast<size_t>( state.range( 1 ) );
+        const auto propagation = static_cast<ColorWave::Propagation>( state.range( 2 ) );
+
+        ColorWave wave( size, size );
+        wave.setPropagation( propagation );
+        wave.init( loadRules( image, 3 ), 1 );
+
+        for ( auto _ : state )
+        {
+            state.PauseTiming();
+            wave.reset( 1 );
+            state.ResumeTiming();
+
+            wave.collapse( false );
+        }
+        state.counters["cells/s"] = benchmark::Counter( static_cast<double>( size * size ), benchmark::Counter::kIsIterationInvariantRate );
+        state.SetLabel( Images[image] );
+    }
+
+    BENCHMARK( BM_Collapse )->ArgNames( { "image", "size", "propagation" } )
+        ->ArgsProduct( { { 0, 1 }, { 64, 256 }, { ColorWave::Bitsets, ColorWave::Supports } } )
+        ->Unit( benchmark::kMillisecond );
+
+    // a single run is long enough for the big fields
+    BENCHMARK( BM_Collapse )->ArgNames( { "image", "size", "propagation" } )
+        ->ArgsProduct( { { 0, 1 }, { 1024 }, { ColorWave::Bitsets, ColorWave::Supports } } )
+        ->Unit( benchmark::kMillisecond )->Iterations( 1 );
+}
+
+BENCHMARK_MAIN();
@@ -1,913 +1,6804 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cstdint>
 #include <cstring>
+#include <fstream>
+#include <iterator>
 #include <memory>
-#include <queue>
+#include <mutex>
 #include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
+/*
+* The vector versions of the bitset operations are chosen at compile time from the target
+* architecture flags (i.e. -mavx2, -mavx512f, -march=native, /arch:AVX2, or NEON on ARM).
+* Define C011APSY_NO_SIMD to force the portable scalar code
+*/
+#if !defined( C011APSY_NO_SIMD )
+    #if defined( __AVX512F__ )
+        #define C011APSY_AVX512
+    #endif
+    #if defined( __AVX512VPOPCNTDQ__ ) && defined( C011APSY_AVX512 )
+        #define C011APSY_AVX512_POPCNT
+    #endif
+    #if defined( __AVX2__ )
+        #define C011APSY_AVX2
+    #endif
+    #if defined( __ARM_NEON ) || defined( __ARM_NEON__ )
+        #define C011APSY_NEON
+    #endif
+#endif
+
+#if defined( C011APSY_AVX512 ) || defined( C011APSY_AVX2 )
+    #include <immintrin.h>
+#endif
+#if defined( C011APSY_NEON )
+    #include <arm_neon.h>
+#endif
+#if defined( _MSC_VER )
+    #include <intrin.h>
+#endif
+
+/*
+* The compiled rules files are mapped into memory with mmap(), or MapViewOfFile() on Windows, see Wave::RuleSet::map().
+* Define C011APSY_NO_MMAP to read them into memory instead and keep the system headers out
+*/
+#if !defined( C011APSY_NO_MMAP )
+    #if defined( _WIN32 )
+        #define C011APSY_MMAP_WIN32
+        #if !defined( NOMINMAX )
+            #define NOMINMAX
+        #endif
+        #include <windows.h>
+    #elif defined( __unix__ ) || defined( __APPLE__ )
+        #define C011APSY_MMAP_POSIX
+        #include <fcntl.h>
+        #include <sys/mman.h>
+        #include <sys/stat.h>
+        #include <unistd.h>
+    #endif
+#endif
+
+/*
+* Define C011APSY_STATS to collect the solver counters and the phase timings, see Wave::getStats().
+* Without it the counting code is not compiled at all
+*/
+#if defined( C011APSY_STATS )
+    #define C011APSY_STAT( ... ) __VA_ARGS__
+#else
+    #define C011APSY_STAT( ... )
+#endif
+
 namespace c011apsy
 {
-    /*
-    * Just a basic bitset that can be instantiated at runtime.
-    */
-    class Bitset
+    namespace detail
     {
-        static const uint8_t Stride = 64; // uint64_t
-    public:
-        explicit Bitset( size_t size, bool on = false );
-
         /*
-        * Get the number of significant bits
+        * Single word helpers, these map to a single instruction where the compiler allows it
         */
-        size_t size() const { return m_size; }
+        int popcount( uint64_t n );
+        int ctz( uint64_t n ); /// n must not be zero
+        uint64_t rotl( uint64_t n, int bits );
 
         /*
-        * Get the value of a bit, readonly
+        * Multiply two numbers, get the low half of the 128 bit result
+        * @param[out] high the high half
         */
-        bool operator[]( size_t index ) const;
+        uint64_t mul128( uint64_t a, uint64_t b, uint64_t& high );
 
         /*
-        * Turn a specific bit on or off
+        * The next number of the SplitMix64 sequence, it turns any seed into a well mixed generator state
         */
-        void set( size_t index, bool on );
+        uint64_t splitMix64( uint64_t& state );
 
         /*
-        * Set all bits to on or off
+        * Get a random number in [0, range) with no modulo bias, range must not be zero.
+        * It's a single multiplication most of the time, see D. Lemire "Fast Random Integer Generation in an Interval"
+        * @param rnd a generator of uint64_t over the whole range
         */
-        void reset( bool on );
+        template<class Rnd>
+        uint64_t bounded( Rnd& rnd, uint64_t range );
 
         /*
-        * Intersect this Bitset with another one. After the operation, the only bits
-        * turned on will be those that were turned on in both Bitsets
+        * Get a random number in [0, 1), the top 53 bits of the generator's output
         */
-        void intersect( const Bitset& other );
+        template<class Rnd>
+        double unitReal( Rnd& rnd );
 
         /*
-        * Create a uninon of two Bitsets. After the opertation, the bits will be turned on
-        * if they were turned on in either Bitset
+        * Make a generator of an independent stream, same state and same stream give the same generator.
+        * The generators with no split() of their own (e.g. std::mt19937_64) are seeded with a mix of the next number and the stream
         */
-        void add( const Bitset& other );
+        template<class Rnd>
+        Rnd splitRandom( const Rnd& rnd, uint64_t stream );
 
         /*
-        * Check if no bit is turned on
+        * Bitset operations on raw memory blocks, shared by all the bitset flavors below.
+        * @param words the number of uint64_t in a block
+        * @param bits the number of significant bits in a block, may be less than words * 64
         */
-        bool empty() const;
+        size_t wordCount( size_t bits );
+        void fill( uint64_t* dst, size_t words, size_t bits, bool on );
+        void intersect( uint64_t* dst, const uint64_t* src, size_t words );
+        void add( uint64_t* dst, const uint64_t* src, size_t words );
+        bool empty( const uint64_t* src, size_t words );
+        size_t count( const uint64_t* src, size_t words );
+        bool single( const uint64_t* src, size_t words );
+        size_t first( const uint64_t* src, size_t words, size_t bits );
 
         /*
-        * Get the number of bits turned on
+        * Fused operations, the result is obtained in the same pass
         */
-        size_t count() const;
+        size_t intersectCount( uint64_t* dst, const uint64_t* src, size_t words ); /// returns the new count of dst
+        bool intersectChanged( uint64_t* dst, const uint64_t* src, size_t words ); /// returns false if dst is left intact
 
         /*
-        * Check if exatctly one bit is turned on
+        * Call f( index ) for every bit that is turned on, in ascending order
         */
-        bool single() const;
+        template<class F>
+        void forEach( const uint64_t* src, size_t words, F&& f );
 
         /*
-        * Get the index of the first bit that is turned on.
-        * Return m_size if no bits are set
+        * Hash a block of memory, the result is well mixed, so it's safe to combine such hashes linearly
         */
-        size_t first() const;
+        uint64_t hashBytes( const void* data, size_t size );
 
-    private:
-        std::vector<uint64_t> m_data;
-        size_t m_size;
-    };
-
-    /*
-    * The class that actually does all the work here
-    */
-    template<class T>
-    class Wave
-    {
-    public:
         /*
-        * Each field element is a bitset, bits mark which tiles are possible to place
+        * Get the rolling hashes of all the windows of the given size inside a 2D block
+        * @param hashes a hash for each element of the block, stored row-by-row
+        * @param width
+        * @param height block dimensions
+        * @param windowWidth
+        * @param windowHeight window dimensions, the hash of an empty window is zero
+        * @return (width - windowWidth + 1) * (height - windowHeight + 1) hashes, [y * (width - windowWidth + 1) + x]
+        * is the hash of the window with its top-left corner at (x, y). Windows with the same content get the same hash
         */
-        using Field = std::vector<Bitset>;
+        std::vector<uint64_t> windowHashes(
+            const std::vector<uint64_t>& hashes,
+            size_t width, size_t height,
+            size_t windowWidth, size_t windowHeight );
+
         /*
-        * User may provide a callback to observe the collapse process in real time.
-        * @param wave an object that called this callback
-        * @param x
-        * @param y coordinates of the last processed field cell
+        * The multipliers of windowHashes(), everything is computed modulo 2^64. They are odd,
+        * and different for rows and columns so transposed windows don't collide
         */
-        using Callback = void (*)( Wave<T>& wave, size_t x, size_t y );
+        static const uint64_t HashRowBase = 0x9e3779b97f4a7c15ull;
+        static const uint64_t HashColBase = 0xc2b2ae3d27d4eb4full;
 
         /*
-        * A lame enum to make it easier to navigate inside the field
+        * One of the 8 ways to rotate or reflect a tile: the transposition goes first, then the flips
         */
-        enum Dir
+        struct Transform
         {
-            Up = 0,
-            Down,
-            Left,
-            Right,
+            bool swap; /// swap x and y, square tiles only
+            bool flipX;
+            bool flipY;
         };
 
         /*
-        * This struct holds the information about tiles relationship. See below
+        * Get the transforms for the given symmetries, the identity goes first
+        * @param rotations add the rotations by 90, 180 and 270 degrees (only 180 if the tiles are not square)
+        * @param reflections add the horizontal and the vertical mirrors
         */
-        struct Neighbors;
+        std::vector<Transform> symmetryTransforms( bool rotations, bool reflections, bool square );
 
         /*
-        * This struct holds the initial state of the Wave
+        * Find an element of a transformed tile in the original one
+        * @param stride the row length of the block the original tile is in
+        * @param tileWidth
+        * @param tileHeight the original tile dimensions
+        * @param x
+        * @param y the element position in the transformed tile
+        * @return the offset from the original tile's top-left element
         */
-        struct Seed;
+        size_t transformedOffset( Transform t, size_t stride, size_t tileWidth, size_t tileHeight, size_t x, size_t y );
 
-    public:
         /*
-        * Constructor
+        * Get the hash of a window inside a transformed tile, it's the same windowHashes() would give for the transformed tile itself
+        * @param hashes the element hashes, starting at the original tile's top-left element
+        * @param stride, tileWidth, tileHeight see transformedOffset()
+        * @param x
+        * @param y the window position in the transformed tile
         * @param width
-        * @param height result dimensions
+        * @param height window dimensions
         */
-        Wave( size_t width, size_t height );
+        uint64_t transformedHash(
+            const uint64_t* hashes, size_t stride,
+            size_t tileWidth, size_t tileHeight, Transform t,
+            size_t x, size_t y, size_t width, size_t height );
 
         /*
-        * Initialize the Wave from the prepared seed
+        * Split [0, count) into contiguous ranges and process them concurrently
+        * @param threads the number of threads to use, including the calling one
+        * @param f a function to call as f( begin, end ) for each range
         */
-        void init( const Seed& seed );
+        template<class F>
+        void parallelFor( size_t count, size_t threads, F&& f );
 
         /*
-        * Initialize the Wave from a pattern
-        * @param pattern a block of memory describing the pattern
-        * @param patternWidth
-        * @param patternHeight pattern dimensions
-        * @param tileWidth
-        * @param tileHeight tile dimensions inside the pattern
-        * @param rndSeed a seed for the random generator. Same seed will produce the same output
+        * Call f( i ) for every i in [0, Count), the calls are spelled out at compile time,
+        * so every one of them sees i as a constant
         */
-        void init(
-            const std::vector<T>& pattern,
-            size_t patternWidth, size_t patternHeight,
-            size_t tileWidth, size_t tileHeight,
-            size_t rndSeed = 0 );
+        template<int Count, class F>
+        void unroll( F&& f );
 
         /*
-        * Run the collapse process.
-        * @param onestep a flag that tells the Wave you only want one simulation step at a time. 
-        * If this parameter is true, you need to call this method until it returns true to obtain the final result
-        * @param callback a callback function, it will be called after each processed cell.
-        * Keep in mind it may take several steps to set a cell to its final value
+        * Add the time spent in a scope to a total, see C011APSY_STATS
         */
-        bool collapse( bool oneStep, Callback c = nullptr );
+        class ScopedTimer
+        {
+        public:
+            explicit ScopedTimer( std::chrono::duration<double, std::milli>& total );
+            ~ScopedTimer();
 
-        /*
-        * Get the current operation progress, percent
-        * @note don't expect the progress to grow in a constant pace
-        */
-        float getProgress() const;
+            ScopedTimer( const ScopedTimer& ) = delete;
+            ScopedTimer& operator=( const ScopedTimer& ) = delete;
+
+        private:
+            std::chrono::duration<double, std::milli>& m_total;
+            std::chrono::steady_clock::time_point m_start;
+        };
 
         /*
-        * Get the initial Wave state. You may use this seed to iniitialize other waves, or to save/load the Wave's state.
+        * Extend a 2D block with a copy of its own beginning, so the windows that cross the edges could be taken as usual
+        * @param width
+        * @param height block dimensions, receive the extended ones
+        * @param extraWidth
+        * @param extraHeight how many columns and rows to add
         */
-        Seed& getSeed();
+        template<class T>
+        std::vector<T> wrapPattern( const std::vector<T>& pattern, size_t& width, size_t& height, size_t extraWidth, size_t extraHeight );
 
         /*
-        * Get the current field state.
+        * The beginning of a compiled rules file, see Wave::RuleSet::save().
+        * The sections follow in the order of their offsets, each one is aligned to RulesAlignment bytes
         */
-        Field& getField();
+        struct RulesHeader
+        {
+            char magic[8]; /// RulesMagic
+            uint32_t version; /// RulesVersion
+            uint32_t byteOrder; /// RulesByteOrder as written by the machine that saved the file
+            uint64_t tileSize; /// sizeof( T )
+            uint64_t tiles;
+            uint64_t neighbors; /// number of allowed (tile, direction, tile) combinations
+            uint64_t stride; /// uint64_t per neighbor set
+            uint64_t directions; /// neighbor sets per tile, see Wave::Directions
+            uint64_t tilesOffset; /// tiles * tileSize bytes
+            uint64_t weightsOffset; /// tiles doubles
+            uint64_t neighborsOffset; /// tiles * Directions neighbor sets, [tile * Directions + dir]
+            uint64_t openOffset; /// 4 neighbor sets, the tiles allowed next to a cell with all tiles possible
+            uint64_t size; /// the whole file
+        };
+
+        static const char RulesMagic[8] = { 'c', '0', '1', '1', 'r', 'u', 'l', 'e' };
+        static const uint32_t RulesVersion = 2;
+        static const uint32_t RulesByteOrder = 0x01020304;
+        static const size_t RulesAlignment = 64;
 
         /*
-        * Get the tiles that were generated for this Wave
+        * The beginning of a solver state snapshot, see Wave::checkpoint().
+        * The variable sized sections follow, each one starts with its element count
         */
-        const std::vector<T>& getTiles() const;
+        struct CheckpointHeader
+        {
+            char magic[8]; /// CheckpointMagic
+            uint32_t version; /// CheckpointVersion
+            uint32_t byteOrder; /// RulesByteOrder as written by the machine that took the checkpoint
+            uint64_t chain; /// the same for a full checkpoint and all the incremental ones taken after it
+            uint64_t sequence; /// zero for a full checkpoint, every incremental one is the previous one + 1
+            uint64_t width;
+            uint64_t height;
+            uint64_t depth;
+            uint64_t tiles;
+            uint64_t stride; /// uint64_t per cell
+            uint32_t propagation;
+            uint32_t contradiction;
+            uint64_t rndSeed;
+            uint64_t uncertainty;
+            uint64_t backtracks;
+            uint64_t restarts;
+            uint64_t runBacktracks;
+            uint64_t entropyMin;
+            uint8_t stepPending;
+            uint8_t conflict;
+            uint8_t gaveUp;
+            uint8_t wrap;
+            uint8_t padding[4];
+        };
+
+        static const char CheckpointMagic[8] = { 'c', '0', '1', '1', 's', 't', 'a', 't' };
+        static const uint32_t CheckpointVersion = 2;
 
         /*
-        * Field width
+        * Append plain values to a byte buffer
         */
-        size_t getFieldWidth() const;
+        template<class X>
+        void append( std::vector<uint8_t>& out, const X* values, size_t count );
 
         /*
-        * Field height
+        * Reads plain values from a memory block, the reads past the end fail
         */
-        size_t getFieldHeight() const;
+        class ByteReader
+        {
+        public:
+            ByteReader( const void* data, size_t size ) : m_data( static_cast<const uint8_t*>( data ) ), m_size( size ) {}
+
+            /*
+            * Copy the values out and move on
+            * @return false if there's not enough data left
+            */
+            template<class X>
+            bool read( X* values, size_t count );
+
+            template<class X>
+            bool read( X& value ) { return read( &value, 1 ); }
+
+            /*
+            * Move on without copying
+            * @return the skipped bytes, nullptr if there's not enough data left
+            */
+            const uint8_t* skip( size_t bytes );
+
+        private:
+            const uint8_t* m_data;
+            size_t m_size;
+            size_t m_pos = 0;
+        };
+    }
+
+    /*
+    * Map a whole file into memory, read-only. RuleSet::map() uses it, and it's handy for any other file
+    * that is read in place, e.g. an image. Without mmap() or MapViewOfFile() the file is just read into memory
+    * @param size receives the file size
+    * @return the memory, it's unmapped when the last copy of the pointer is gone. nullptr if the file couldn't be read
+    */
+    std::shared_ptr<const void> mapFile( const std::string& path, size_t& size );
+
+    /*
+    * Most of the bitset flavors below are parametrized by the number of uint64_t they occupy.
+    * Zero means the size is only known at runtime, any other value lets the compiler unroll the loops.
+    */
+    template<size_t Words>
+    struct WordCount
+    {
+        static size_t get( size_t ) { return Words; }
+    };
+
+    template<>
+    struct WordCount<0>
+    {
+        static size_t get( size_t bits ) { return detail::wordCount( bits ); }
+    };
+
+    template<size_t Words>
+    class BasicBitsetView;
+
+    /*
+    * A readonly reference to a bitset stored somewhere else.
+    * It's cheap to copy, so pass it by value
+    */
+    template<size_t W = 0>
+    class BasicConstBitsetView
+    {
+    public:
+        static const size_t Words = W;
+
+        BasicConstBitsetView( const uint64_t* data, size_t size );
 
         /*
-        * Run the single step
-        * @param id0 the index of the cell that will be collapsed by force
-        * @param c callback
+        * Any bitset of the same capacity could be viewed, a runtime-sized view accepts all of them
         */
-        void collapseStep( size_t id0, Callback c );
+        template<class Other, class = typename std::enable_if<W == 0 || Other::Words == W>::type>
+        BasicConstBitsetView( const Other& other )
+            : BasicConstBitsetView( other.data(), other.size() ) {}
 
-    private:
         /*
-        * Perform the cell collapse. It uses the tiles' weights to determine which tile to place
-        * @param id the index of a cell to collapse
+        * Get the number of significant bits
         */
-        void collapseCell( size_t id );
+        size_t size() const { return m_size; }
 
         /*
-        * Check the cell current possible tiles, and its neighbors.
-        * Get the intersection of these sets and assign it to the cell.
-        * @param id the cell id to check
+        * Get the memory block the bits are stored in
         */
-        void filterCandidates( size_t id );
+        const uint64_t* data() const { return m_data; }
 
         /*
-        * Find the field cell with the lowest "enthropy".
-        * @param[out] totalUncertainty total amount of tiles are still possible to place on a field.
-        * When this parameter is equal to the field size it means thealgorithm is done, there's only 
-        * one possible tile for each field cell
+        * Get the number of uint64_t in the memory block
         */
-        size_t getCollapsePoint( size_t& totalUncertainty ) const;
+        size_t words() const { return WordCount<W>::get( m_size ); }
 
         /*
-        * Propagate the cell processing through the field.
-        * @param id0 the id of the cell to pass the processing from
-        * @param wavefront the queue of the cells to be processed
-        * @param visited a collection that indicates which cells were  already visited during the current step
+        * See Bitset
         */
-        void propagate(
-            size_t id0,
-            std::queue<size_t>& wavefront );
+        bool operator[]( size_t index ) const;
+        bool empty() const;
+        size_t count() const;
+        bool single() const;
+        size_t first() const;
 
-        /**
-        * Check two tiles if they could be placed alongside each other
-        * (with a shift of 1 cell to a given direction)
-        * @param original the first tile to be compared
-        * @param candidate the second tile to be compared
-        * @param dir the shift direction to check
-        * @param w
-        * @param h tile dimensions
-        */
-        bool isNeighbor(
-            const std::vector<T>& original,
-            const std::vector<T>& candidate,
-            Dir dir, size_t w, size_t h ) const;
+        template<class F>
+        void forEach( F&& f ) const { detail::forEach( m_data, words(), f ); }
 
-        /*
-        * Get the neighboring cell to a given one in a specific direction
-        * @param x
-        * @param y coordinates of a cell to get a neighbor of
-        * @param dir neighbor direction
-        */
-        const Bitset& getNeighbor( size_t x, size_t y, int dir ) const;
+    private:
+        const uint64_t* m_data;
+        size_t m_size;
+    };
+
+    /*
+    * A reference to a bitset stored somewhere else (see BasicBitsetArray), all the operations are done in place.
+    * It's cheap to copy, so pass it by value
+    */
+    template<size_t W = 0>
+    class BasicBitsetView
+    {
+    public:
+        static const size_t Words = W;
+
+        BasicBitsetView( uint64_t* data, size_t size );
 
         /*
-        * Helper, just reverse the direction
-        * Up <-> Down, Left <-> Right
+        * Get the number of significant bits
         */
-        Dir revDir( int dir ) const;
+        size_t size() const { return m_size; }
 
         /*
-        * Helper, get the field linear cell id from its coordinates
+        * Get the memory block the bits are stored in
         */
-        size_t fieldIndex( size_t x, size_t y ) const;
+        uint64_t* data() const { return m_data; }
 
         /*
-        * Initialize the random numbers gen, using the seed from m_seed
+        * Get the number of uint64_t in the memory block
         */
-        void initRandom();
+        size_t words() const { return WordCount<W>::get( m_size ); }
 
         /*
-        * Initialize the field and helper structures
+        * See Bitset
         */
-        void initField();
+        bool operator[]( size_t index ) const;
+        void set( size_t index, bool on ) const;
+        void reset( bool on ) const;
+        void intersect( BasicConstBitsetView<W> other ) const;
+        size_t intersectCount( BasicConstBitsetView<W> other ) const;
+        bool intersectChanged( BasicConstBitsetView<W> other ) const;
+        void add( BasicConstBitsetView<W> other ) const;
+        bool empty() const;
+        size_t count() const;
+        bool single() const;
+        size_t first() const;
+
+        template<class F>
+        void forEach( F&& f ) const { detail::forEach( m_data, words(), f ); }
 
     private:
-        Seed m_seed;
-        Bitset m_allTiles; /// this Bitset holds all tiles allowed, used to simulate the "neighbor" at the field boundaries
-        std::vector<Bitset> m_possibleNeighbors; /// this is used in filterCandidates()
-        std::unique_ptr<std::mt19937_64> m_mt;
-        Field m_field;
-        std::vector<bool> m_visited; /// store visited cell within a single step
-        std::vector<bool> m_collapsed; /// store cells that are solved, i.e. has only one tile
-        std::vector<size_t> m_collapseCandidates; /// this is used when a cell is collapsed by force
-        size_t m_fieldW;
-        size_t m_fieldH;
-        size_t m_uncertaintyCurrent;
+        uint64_t* m_data;
+        size_t m_size;
     };
 
-    inline
-    Bitset::Bitset( size_t size, bool on )
-        : m_size( size )
-    {
-        size_t dataSize = m_size / Stride + (m_size % Stride > 0);
-        m_data.resize( dataSize, on ? ~uint64_t( 0 ) : 0 );
-        m_data.back() >>= (Stride - m_size % Stride);
-    }
+    using ConstBitsetView = BasicConstBitsetView<>;
+    using BitsetView = BasicBitsetView<>;
 
-    inline
-    bool Bitset::operator[]( size_t index ) const
+    /*
+    * Just a basic bitset that can be instantiated at runtime.
+    */
+    class Bitset
     {
-        assert( index < m_size && "Bitset::operator[] index out of bounds" );
+    public:
+        static const size_t Words = 0;
 
-        const size_t dataId = index / Stride;
-        const uint8_t bitId = index % Stride;
-        return (m_data[dataId] >> bitId) & 0x1;
-    }
+        explicit Bitset( size_t size, bool on = false );
 
-    inline
-    void Bitset::set( size_t index, bool on )
-    {
-        assert( index < m_size && "Bitset::set() index out of bounds" );
+        /*
+        * Get the number of significant bits
+        */
+        size_t size() const { return m_size; }
 
-        const size_t dataId = index / Stride;
-        const uint8_t bitId = index % Stride;
-        const uint64_t mask = uint64_t( 1 ) << bitId;
-        if ( on )
-        {
-            m_data[dataId] |= mask;
-        }
-        else
-        {
-            m_data[dataId] &= (~mask);
-        }
-    }
+        /*
+        * Get the memory block the bits are stored in
+        */
+        const uint64_t* data() const { return m_data.data(); }
+        uint64_t* data() { return m_data.data(); }
 
-    inline
-    void Bitset::reset( bool on )
-    {
-        uint64_t c = on ? ~uint64_t( 0 ) : 0;
-        for ( size_t i = 0; i < m_data.size(); ++i )
-        {
-            m_data[i] = c;
-        }
-        m_data.back() >>= (Stride - m_size % Stride);
-    }
+        /*
+        * Get the value of a bit, readonly
+        */
+        bool operator[]( size_t index ) const;
 
-    inline
-    void Bitset::intersect( const Bitset& other )
-    {
-        assert( other.m_size == m_size && "Bitset::intersect() size mismatch" );
-        for ( size_t i = 0; i < m_data.size(); ++i )
-        {
-            m_data[i] &= other.m_data[i];
-        }
-    }
+        /*
+        * Turn a specific bit on or off
+        */
+        void set( size_t index, bool on );
 
-    inline
-    void Bitset::add( const Bitset& other )
-    {
-        assert( other.m_size == m_size && "Bitset::add() size mismatch" );
-        for ( size_t i = 0; i < m_data.size(); ++i )
-        {
-            m_data[i] |= other.m_data[i];
-        }
-    }
+        /*
+        * Set all bits to on or off
+        */
+        void reset( bool on );
 
-    inline
-    bool Bitset::empty() const
-    {
-        for ( uint64_t n : m_data )
+        /*
+        * Intersect this Bitset with another one. After the operation, the only bits
+        * turned on will be those that were turned on in both Bitsets
+        */
+        void intersect( ConstBitsetView other );
+
+        /*
+        * Same as intersect(), but also return the number of bits left turned on
+        */
+        size_t intersectCount( ConstBitsetView other );
+
+        /*
+        * Same as intersect(), but also tell if any bit was turned off
+        */
+        bool intersectChanged( ConstBitsetView other );
+
+        /*
+        * Create a uninon of two Bitsets. After the opertation, the bits will be turned on
+        * if they were turned on in either Bitset
+        */
+        void add( ConstBitsetView other );
+
+        /*
+        * Check if no bit is turned on
+        */
+        bool empty() const;
+
+        /*
+        * Get the number of bits turned on
+        */
+        size_t count() const;
+
+        /*
+        * Check if exatctly one bit is turned on
+        */
+        bool single() const;
+
+        /*
+        * Get the index of the first bit that is turned on.
+        * Return m_size if no bits are set
+        */
+        size_t first() const;
+
+        /*
+        * Call f( index ) for each bit that is turned on, in ascending order
+        */
+        template<class F>
+        void forEach( F&& f ) const { detail::forEach( m_data.data(), m_data.size(), f ); }
+
+        /*
+        * Get a view of this Bitset
+        */
+        BitsetView view() { return BitsetView( m_data.data(), m_size ); }
+
+    private:
+        std::vector<uint64_t> m_data;
+        size_t m_size;
+    };
+
+    /*
+    * A bitset of the compile-time capacity (W * 64 bits) stored inline, without any heap allocations.
+    * The number of significant bits is still set at runtime, but it can't exceed the capacity
+    */
+    template<size_t W>
+    class FixedBitset
+    {
+        static_assert( W > 0, "FixedBitset needs a non-zero capacity, use Bitset instead" );
+    public:
+        static const size_t Words = W;
+
+        explicit FixedBitset( size_t size, bool on = false );
+
+        /*
+        * See Bitset
+        */
+        size_t size() const { return m_size; }
+        const uint64_t* data() const { return m_data.data(); }
+        uint64_t* data() { return m_data.data(); }
+        bool operator[]( size_t index ) const { return view()[index]; }
+        void set( size_t index, bool on ) { view().set( index, on ); }
+        void reset( bool on ) { view().reset( on ); }
+        void intersect( BasicConstBitsetView<W> other ) { view().intersect( other ); }
+        size_t intersectCount( BasicConstBitsetView<W> other ) { return view().intersectCount( other ); }
+        bool intersectChanged( BasicConstBitsetView<W> other ) { return view().intersectChanged( other ); }
+        void add( BasicConstBitsetView<W> other ) { view().add( other ); }
+        bool empty() const { return view().empty(); }
+        size_t count() const { return view().count(); }
+        bool single() const { return view().single(); }
+        size_t first() const { return view().first(); }
+
+        template<class F>
+        void forEach( F&& f ) const { view().forEach( f ); }
+
+        BasicBitsetView<W> view() { return BasicBitsetView<W>( m_data.data(), m_size ); }
+        BasicConstBitsetView<W> view() const { return BasicConstBitsetView<W>( m_data.data(), m_size ); }
+
+    private:
+        std::array<uint64_t, W> m_data;
+        size_t m_size;
+    };
+
+    /*
+    * A number of same-sized bitsets, stored one after another in a single memory block.
+    * Bitsets are accessed through views, see BasicBitsetView.
+    * In the compact mode (see setCompact()) only the bitsets with several bits on hold memory of their own,
+    * the empty ones, the full ones and the ones with a single bit on refer to a shared read-only copy
+    */
+    template<size_t W = 0>
+    class BasicBitsetArray
+    {
+        static const size_t Alignment = 64; // bytes, a typical cache line
+        static const size_t BlockSize = 1024; // bitsets per memory block in the compact mode
+        static const uint32_t Shared = 0x80000000u; // the slots starting from this one are in m_shared
+
+        template<class View, class Array>
+        class Iterator
+        {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = View;
+            using difference_type = std::ptrdiff_t;
+            using pointer = void;
+            using reference = View;
+
+            Iterator( Array* array, size_t index )
+                : m_array( array ), m_index( index ) {}
+
+            View operator*() const { return (*m_array)[m_index]; }
+            Iterator& operator++() { ++m_index; return *this; }
+            Iterator operator++( int ) { Iterator it = *this; ++m_index; return it; }
+            bool operator==( const Iterator& other ) const { return m_index == other.m_index; }
+            bool operator!=( const Iterator& other ) const { return m_index != other.m_index; }
+
+        private:
+            Array* m_array;
+            size_t m_index;
+        };
+
+    public:
+        static const size_t Words = W;
+
+        using View = BasicBitsetView<W>;
+        using ConstView = BasicConstBitsetView<W>;
+        using iterator = Iterator<View, BasicBitsetArray>;
+        using const_iterator = Iterator<ConstView, const BasicBitsetArray>;
+
+        BasicBitsetArray() = default;
+        BasicBitsetArray( const BasicBitsetArray& other );
+        BasicBitsetArray( BasicBitsetArray&& other ) = default;
+        BasicBitsetArray& operator=( const BasicBitsetArray& other );
+        BasicBitsetArray& operator=( BasicBitsetArray&& other ) = default;
+
+        /*
+        * Set the number of bitsets and their size, all bits are set to on or off.
+        * The memory is reused when possible
+        */
+        void assign( size_t count, size_t bits, bool on );
+
+        /*
+        * Use the bitsets stored somewhere else, stride() uint64_t each, instead of a copy.
+        * The memory is not owned, it must outlive the array and must not be written through it.
+        * Any assign() makes the array own its memory again
+        */
+        void attach( const uint64_t* data, size_t count, size_t bits );
+
+        /*
+        * Get the number of bitsets
+        */
+        size_t size() const { return m_count; }
+        bool empty() const { return m_count == 0; }
+
+        /*
+        * Get the number of bits in each bitset
+        */
+        size_t bits() const { return m_bits; }
+
+        /*
+        * Get the number of uint64_t occupied by each bitset
+        */
+        size_t stride() const { return WordCount<W>::get( m_bits ); }
+
+        /*
+        * Switch between the single memory block and the compact mode, the content is kept.
+        * It makes sense when most of the bitsets are either full or have a single bit on, e.g. the field cells
+        */
+        void setCompact( bool on );
+        bool compact() const { return m_compact; }
+
+        /*
+        * Release the memory of a bitset if it's empty, full or has a single bit on. Does nothing unless compact().
+        * The views of that bitset obtained earlier must not be used after that
+        */
+        void shrink( size_t index );
+
+        /*
+        * Get the number of uint64_t allocated for the bitsets
+        */
+        size_t capacity() const;
+
+        /*
+        * Get a bitset. In the compact mode the writable access gives the bitset its own memory, see shrink()
+        */
+        View operator[]( size_t index );
+        ConstView operator[]( size_t index ) const { return ConstView( data( index ), m_bits ); }
+
+        /*
+        * Same as ( *this )[index].first(), but the compact single bit bitsets don't need to be scanned
+        */
+        size_t first( size_t index ) const;
+
+        iterator begin() { return iterator( this, 0 ); }
+        iterator end() { return iterator( this, m_count ); }
+        const_iterator begin() const { return const_iterator( this, 0 ); }
+        const_iterator end() const { return const_iterator( this, m_count ); }
+
+    private:
+        const uint64_t* data( size_t index ) const;
+        uint64_t* slotData( uint32_t slot );
+        const uint64_t* slotData( uint32_t slot ) const;
+
+        /*
+        * Prepare m_shared for the current number of bits: the empty bitset, the full one and a single bit for every bit
+        */
+        void initShared();
+
+        std::vector<uint64_t> m_storage; /// a bit larger than needed, to align m_data
+        uint64_t* m_data = nullptr;
+        size_t m_count = 0;
+        size_t m_bits = 0;
+
+        bool m_compact = false;
+        std::vector<uint32_t> m_slots; /// the compact mode only, where every bitset is stored, see slotData()
+        std::vector<std::vector<uint64_t>> m_blocks; /// the compact mode only, BlockSize bitsets each
+        std::vector<uint32_t> m_free; /// the slots in m_blocks that are not used at the moment
+        std::vector<uint64_t> m_shared; /// the compact mode only, see initShared()
+    };
+
+    using BitsetArray = BasicBitsetArray<>;
+
+    /*
+    * A set of cell ids, the ids are kept in the order they were added
+    */
+    class CellSet
+    {
+    public:
+        /*
+        * Make the set empty and ready to hold the ids [0, cells)
+        */
+        void reset( size_t cells );
+
+        void add( size_t id );
+
+        /*
+        * Make the set empty, only the ids in it are visited
+        */
+        void clear();
+
+        bool empty() const { return m_ids.empty(); }
+        const std::vector<uint32_t>& ids() const { return m_ids; }
+
+    private:
+        std::vector<uint32_t> m_ids;
+        std::vector<bool> m_marks; /// [id] the id is in m_ids
+    };
+
+    /*
+    * Groups the field cells by the number of tiles that are still possible to place in them,
+    * so the cell with the lowest "enthropy" could be found without scanning the whole field.
+    * Cells with less than two possible tiles are not tracked
+    */
+    class EntropyIndex
+    {
+    public:
+        /*
+        * Start tracking the cells [0, cells), each of them with the same number of possible tiles
+        */
+        void reset( size_t cells, size_t count );
+
+        /*
+        * Assign a new number of possible tiles to a cell
+        */
+        void update( size_t id, size_t count );
+
+        /*
+        * Get the number of tiles possible to place in a cell
+        */
+        size_t count( size_t id ) const { return m_counts[id]; }
+
+        /*
+        * Check if there are no more cells to collapse
+        */
+        bool empty() const { return m_tracked == 0; }
+
+        /*
+        * Get one of the cells with the lowest number of possible tiles, chosen at random
+        */
+        template<class Rnd>
+        size_t pick( Rnd& rnd );
+
+        /*
+        * Collect the cells that are moved inside their buckets by the updates of the other cells, see moved().
+        * Together with the updated cells these are all the cells which position has changed
+        */
+        void track( bool on );
+
+        /*
+        * The cells moved since track() was called, it's up to the caller to clear the set
+        */
+        CellSet& moved() { return m_moved; }
+
+        /*
+        * The index layout, so it could be restored exactly, see place()
+        */
+        size_t slot( size_t id ) const { return m_slots[id]; }
+        size_t lowest() const { return m_min; }
+        size_t buckets() const { return m_buckets.size(); }
+        size_t bucketSize( size_t count ) const { return m_buckets[count].size(); }
+
+        /*
+        * Restore the layout saved before: the buckets get their old sizes, then the cells that changed since then
+        * are put back to their old places. The rest of the cells should be where they were
+        * @param sizes the size of each bucket
+        * @param buckets the number of buckets
+        * @param lowest see lowest()
+        */
+        void resizeBuckets( const uint32_t* sizes, size_t buckets, size_t lowest );
+        void place( size_t id, size_t count, size_t slot );
+
+    private:
+        void insert( size_t id, size_t count );
+        void erase( size_t id );
+
+        std::vector<std::vector<uint32_t>> m_buckets; /// cell ids grouped by the number of possible tiles
+        std::vector<uint32_t> m_slots; /// position of each cell inside its bucket
+        std::vector<uint32_t> m_counts; /// number of possible tiles for each cell
+        size_t m_min = 0; /// it's guaranteed there are no tracked cells in the buckets below this one
+        size_t m_tracked = 0;
+        bool m_tracking = false; /// see track()
+        CellSet m_moved;
+    };
+
+    /*
+    * xoshiro256** by D. Blackman and S. Vigna, the default random generator of Wave. Its whole state is 32 bytes,
+    * and any number of independent streams could be split from it, see split().
+    * Wave takes any other generator instead, e.g. std::mt19937_64, if it gives uint64_t over the whole range,
+    * could be default constructed, constructed and seeded from a uint64_t, and supports the stream operators (see Wave::checkpoint())
+    */
+    class Xoshiro256
+    {
+    public:
+        using result_type = uint64_t;
+
+        static constexpr result_type min() { return 0; }
+        static constexpr result_type max() { return UINT64_MAX; }
+
+        explicit Xoshiro256( uint64_t value = 0 );
+
+        /*
+        * Start over, the state is made of the seed with SplitMix64
+        */
+        void seed( uint64_t value );
+
+        result_type operator()();
+
+        /*
+        * Get a generator of another stream, e.g. for a chunk solved in parallel. This generator is not changed,
+        * so the streams depend only on its current state and the stream ids, not on the order they're taken in
+        */
+        Xoshiro256 split( uint64_t stream ) const;
+
+        friend std::ostream& operator<<( std::ostream& out, const Xoshiro256& rnd );
+        friend std::istream& operator>>( std::istream& in, Xoshiro256& rnd );
+
+    private:
+        uint64_t m_state[4];
+    };
+
+    namespace detail
+    {
+        Xoshiro256 splitRandom( const Xoshiro256& rnd, uint64_t stream );
+    }
+
+    /*
+    * The field layouts, see the Wave's Topology parameter. A topology tells how many neighbors a cell has
+    * and where they are. The directions go in pairs, so the reverse of a direction is dir ^ 1.
+    * The first four are always Wave::Up, Wave::Down, Wave::Left and Wave::Right, or their closest match.
+    * The cells are stored row-by-row, and layer-by-layer if there are layers.
+    * A custom topology needs the same members:
+    *
+    * Directions the number of directions
+    * Dimensions 3 if the field has layers, see Wave::setDepth(), 2 otherwise
+    * neighbor( id, dir, width, height, depth, wrap, neighbor ) finds the neighbor of the cell id,
+    * returns false if there's none. wrap is the combination of Wave::Wrap flags
+    */
+
+    /*
+    * Default, a plain grid of square cells
+    */
+    struct Grid2D
+    {
+        static const int Directions = 4;
+        static const int Dimensions = 2;
+
+        static bool neighbor( size_t id, int dir, size_t width, size_t height, size_t depth, int wrap, size_t& neighbor );
+    };
+
+    /*
+    * A stack of grids, e.g. the floors of a building. The cell (x, y, z) is at (z * height + y) * width + x
+    */
+    struct Grid3D
+    {
+        static const int Directions = 6;
+        static const int Dimensions = 3;
+
+        enum
+        {
+            Below = 4, /// the previous layer, z - 1
+            Above = 5, /// the next layer, z + 1
+        };
+
+        static bool neighbor( size_t id, int dir, size_t width, size_t height, size_t depth, int wrap, size_t& neighbor );
+    };
+
+    /*
+    * Hexagons with pointy tops, the odd rows are shifted by a half of a cell to the right.
+    * Wrapping the rows around needs an even height
+    */
+    struct HexGrid
+    {
+        static const int Directions = 6;
+        static const int Dimensions = 2;
+
+        enum
+        {
+            UpLeft = 0,
+            DownRight = 1,
+            Left = 2,
+            Right = 3,
+            UpRight = 4,
+            DownLeft = 5,
+        };
+
+        static bool neighbor( size_t id, int dir, size_t width, size_t height, size_t depth, int wrap, size_t& neighbor );
+    };
+
+    /*
+    * The class that actually does all the work here
+    * @param T tile type
+    * @param MaxTiles the maximum number of tiles known at compile time. When it's set, the cells
+    * are stored with a fixed stride and all the bitset operations are unrolled. Zero means the number
+    * of tiles is unlimited, which is the only option if the number is known only after the pattern processing
+    * @param Topology the field layout, see Grid2D. The pattern extraction and the chunked solving
+    * (collapseParallel(), collapseChunk(), regenerateRegion()) work with Grid2D only
+    * @param Random the random generator, see Xoshiro256. Same seed gives the same output only with the same generator
+    */
+    template<class T, size_t MaxTiles = 0, class Topology = Grid2D, class Random = Xoshiro256>
+    class Wave
+    {
+        static const size_t Words = (MaxTiles + 63) / 64;
+
+        /*
+        * A standalone set of tiles with the same capacity as a field cell
+        */
+        using TileSet = typename std::conditional<Words == 0, Bitset, FixedBitset<Words>>::type;
+
+    public:
+        /*
+        * Each field element is a bitset, bits mark which tiles are possible to place.
+        * All the cells are stored in a single memory block, see BasicBitsetArray
+        */
+        using Field = BasicBitsetArray<Words>;
+
+        /*
+        * A reference to a single field cell
+        */
+        using Cell = typename Field::View;
+        using ConstCell = typename Field::ConstView;
+        /*
+        * User may provide a callback to observe the collapse process in real time.
+        * @param wave an object that called this callback
+        * @param x
+        * @param y coordinates of the last processed field cell, y goes through all the layers if there are several
+        */
+        using Callback = void (*)( Wave& wave, size_t x, size_t y );
+
+        /*
+        * Same as Callback, with a pointer to the user data, see setObserver()
+        */
+        using Observer = void (*)( void* context, Wave& wave, size_t x, size_t y );
+
+        /*
+        * A cell change logged in the journal, see setJournal()
+        */
+        struct Change
+        {
+            uint32_t cell; /// the linear cell id, y * getFieldWidth() + x (plus z * getFieldWidth() * getFieldHeight() with layers)
+            uint32_t count; /// the number of tiles still possible in the cell
+        };
+
+        /*
+        * A lame enum to make it easier to navigate inside the field.
+        * The topology may have more directions, see Grid3D and HexGrid
+        */
+        enum Dir
+        {
+            Up = 0,
+            Down,
+            Left,
+            Right,
+        };
+
+        /*
+        * The number of neighbors of a cell, the Dir values go from 0 to Directions - 1
+        */
+        static const int Directions = Topology::Directions;
+
+        /*
+        * The way the cell changes are spread through the field
+        */
+        enum Propagation
+        {
+            /// default, a cell is intersected with the allowed neighbors of every tile that is possible to place around it
+            Bitsets = 0,
+            /// every tile of every cell counts the compatible tiles around it (AC-4),
+            /// only the removed tiles are propagated. It needs tiles * 8 bytes per cell,
+            /// but scales a lot better with the number of tiles. Not available for more than 65535 tiles
+            Supports,
+        };
+
+        /*
+        * What to do when a cell runs out of possible tiles
+        */
+        enum Contradiction
+        {
+            /// default, the cell gets all the tiles its neighbors allow on their own, so the result may break the rules
+            Fallback = 0,
+            /// undo the latest decisions and try the other tiles instead. When it takes too many attempts,
+            /// the whole collapse starts over. Every change is logged, so it needs more memory
+            Backtrack,
+        };
+
+        /*
+        * How the field cells are stored
+        */
+        enum Storage
+        {
+            /// default, every cell holds a bitset of all the tiles, tiles / 8 bytes per cell
+            Dense = 0,
+            /// only the cells that still have several tiles to choose from hold a bitset,
+            /// the solved ones and the untouched ones take 4 bytes. The field access is a bit slower,
+            /// but the memory depends on the number of cells being solved at the moment, not on the field size
+            Compact,
+        };
+
+        /*
+        * The edges that wrap around, so the result tiles seamlessly. These are flags, combine them with |
+        */
+        enum Wrap
+        {
+            NoWrap = 0,
+            WrapX = 1, /// the left edge touches the right one
+            WrapY = 2, /// the top edge touches the bottom one
+            WrapXY = WrapX | WrapY,
+            WrapZ = 4, /// the first layer touches the last one, Grid3D only
+        };
+
+        /*
+        * The transformed copies of the pattern tiles to add to the tileset. These are flags, combine them with |
+        */
+        enum Symmetry
+        {
+            NoSymmetry = 0,
+            Rotations = 1, /// the tiles rotated by 90, 180 and 270 degrees, only by 180 if the tiles are not square
+            Reflections = 2, /// the tiles mirrored horizontally and vertically
+            AllSymmetries = Rotations | Reflections, /// all the 8 variants, the first two plus the diagonal mirrors
+        };
+
+        /*
+        * This struct holds the information about tiles relationship. See below
+        */
+        struct Neighbors;
+
+        /*
+        * This struct holds the initial state of the Wave
+        */
+        struct Seed;
+
+        /*
+        * The summary of the last init() call
+        */
+        struct InitReport
+        {
+            size_t tiles = 0; /// number of unique tiles
+            size_t samples = 0; /// number of tile-sized areas scanned in the pattern
+            size_t comparisons = 0; /// number of tile pairs compared while building the adjacency
+            size_t neighbors = 0; /// number of allowed (tile, direction, tile) combinations
+            std::chrono::duration<double, std::milli> extraction{ 0 }; /// time spent on finding unique tiles
+            std::chrono::duration<double, std::milli> adjacency{ 0 }; /// time spent on the tiles relationship
+        };
+
+        /*
+        * The solver counters since the last init() or reset(), see getStats().
+        * The helper waves of collapseParallel() and regenerateRegion() are counted too, so the timings
+        * are the sum over all the threads
+        */
+        struct Stats
+        {
+            size_t collapses = 0; /// cells collapsed on purpose, i.e. the steps taken
+            size_t pops = 0; /// cells (Bitsets) or tile removals (Supports) taken from the propagation queue
+            size_t filters = 0; /// filterCandidates() calls
+            size_t bitsRemoved = 0; /// tiles removed from the cells, by the collapses and the propagation
+            size_t contradictions = 0; /// cells that ran out of tiles
+            size_t peakWavefront = 0; /// the longest the propagation queue has been
+            size_t bytes = 0; /// memory held by the field and the solver buffers at the moment
+            std::chrono::duration<double, std::milli> extraction{ 0 }; /// the rules build, see InitReport
+            std::chrono::duration<double, std::milli> adjacency{ 0 }; /// same
+            std::chrono::duration<double, std::milli> selection{ 0 }; /// time spent on finding the cells to collapse
+            std::chrono::duration<double, std::milli> propagation{ 0 }; /// time spent on propagating the changes
+        };
+
+        /*
+        * Check if the stats are collected, i.e. C011APSY_STATS is defined
+        */
+#if defined( C011APSY_STATS )
+        static const bool StatsEnabled = true;
+#else
+        static const bool StatsEnabled = false;
+#endif
+
+        /*
+        * The expected cost of a generation, see estimate()
+        */
+        struct Estimate
+        {
+            size_t tiles = 0; /// number of unique tiles
+            size_t neighbors = 0; /// number of allowed (tile, direction, tile) combinations
+            double density = 0; /// the share of the allowed combinations, neighbors / (tiles * tiles * Directions)
+            size_t rulesBytes = 0; /// memory taken by the rules, see RuleSet
+            size_t fieldBytes = 0; /// memory taken by the field and the helper structures, Storage::Dense
+            size_t supportsBytes = 0; /// extra memory Propagation::Supports needs on top of that
+            double bitsetsCost = 0; /// rough number of uint64_t operations to solve the field with Propagation::Bitsets
+            double supportsCost = 0; /// rough number of counter updates to solve the field with Propagation::Supports
+        };
+
+        /*
+        * The compiled tiles relationship: tiles, weights and the packed adjacency.
+        * It's read-only once built, so any number of Waves (even the concurrent ones) may share a single copy. See below
+        */
+        class RuleSet;
+        using RuleSetPtr = std::shared_ptr<const RuleSet>;
+
+        /*
+        * Tile ids right outside the field, taken from the already generated neighbors. See collapseChunk()
+        */
+        struct Borders
+        {
+            std::vector<uint32_t> up; /// the bottom row of the neighbor above, getFieldWidth() ids or empty if there's no neighbor
+            std::vector<uint32_t> down; /// the top row of the neighbor below
+            std::vector<uint32_t> left; /// the rightmost column of the neighbor to the left, getFieldHeight() ids or empty
+            std::vector<uint32_t> right; /// the leftmost column of the neighbor to the right
+        };
+
+    public:
+        /*
+        * Constructor
+        * @param width
+        * @param height result dimensions
+        */
+        Wave( size_t width, size_t height );
+
+        /*
+        * Constructor, the Wave is initialized with the given rules right away
+        * @param width
+        * @param height result dimensions
+        * @param rules the rules to share
+        * @param rndSeed a seed for the random generator
+        */
+        Wave( size_t width, size_t height, RuleSetPtr rules, size_t rndSeed = 0 );
+
+        /*
+        * Initialize the Wave from the prepared seed
+        */
+        void init( const Seed& seed );
+
+        /*
+        * Initialize the Wave from the compiled rules, nothing is copied
+        * @param rules the rules to share
+        * @param rndSeed a seed for the random generator. Same seed will produce the same output
+        */
+        void init( RuleSetPtr rules, size_t rndSeed = 0 );
+
+        /*
+        * Start over with the same rules, every tile becomes possible again.
+        * The existing buffers are rewritten in place, so nothing is allocated after the first run
+        * @param rndSeed a seed for the random generator
+        */
+        void reset( size_t rndSeed = 0 );
+
+        /*
+        * Same as reset(), but the field gets new dimensions.
+        * The buffers only grow, so shrinking or getting back to the old size is allocation-free
+        * @param width
+        * @param height new result dimensions
+        * @param rndSeed a seed for the random generator
+        */
+        void resize( size_t width, size_t height, size_t rndSeed = 0 );
+
+        /*
+        * Set the number of layers of the field, for the topologies that have them, see Grid3D.
+        * Takes effect on the next init(), reset() or resize(). The default is 1
+        */
+        void setDepth( size_t depth );
+
+        /*
+        * Initialize the Wave from a pattern
+        * @param pattern a block of memory describing the pattern
+        * @param patternWidth
+        * @param patternHeight pattern dimensions
+        * @param tileWidth
+        * @param tileHeight tile dimensions inside the pattern
+        * @param rndSeed a seed for the random generator. Same seed will produce the same output
+        * @param patternWrap the pattern edges that wrap around, see Wrap. The tiles crossing them are taken too
+        * @param symmetry the transformed tiles to add, see Symmetry. Each variant gets the weight of the tile it's made of,
+        * the same as if the pattern was rotated and mirrored by hand, but in a fraction of the time
+        */
+        void init(
+            const std::vector<T>& pattern,
+            size_t patternWidth, size_t patternHeight,
+            size_t tileWidth, size_t tileHeight,
+            size_t rndSeed = 0,
+            int patternWrap = NoWrap,
+            int symmetry = NoSymmetry );
+
+        /*
+        * Set the number of threads the Wave is allowed to use, including the calling one.
+        * Zero means all the hardware threads available. The default is 1
+        */
+        void setThreads( size_t threads );
+
+        /*
+        * Get the number of threads the Wave is allowed to use
+        */
+        size_t getThreads() const;
+
+        /*
+        * Get the summary of the last initialization: the tile count, the time it took, etc.
+        */
+        const InitReport& getInitReport() const;
+
+        /*
+        * Choose the propagation method, see Propagation.
+        * Takes effect immediately, although it's cheaper to call it before init()
+        */
+        void setPropagation( Propagation mode );
+
+        /*
+        * Get the current propagation method
+        */
+        Propagation getPropagation() const;
+
+        /*
+        * Make the field edges wrap around, see Wrap. The cells at the edges are the neighbors of the ones at the opposite edges,
+        * so the result tiles seamlessly. Better call it before the collapse starts
+        */
+        void setWrap( int wrap );
+
+        /*
+        * Get the field edges that wrap around
+        */
+        int getWrap() const;
+
+        /*
+        * Choose how the field is stored, see Storage. Takes effect immediately.
+        * @note Propagation::Supports needs a lot of memory on its own, so it's better to combine Compact with Bitsets
+        */
+        void setStorage( Storage mode );
+
+        /*
+        * Get the current field storage method
+        */
+        Storage getStorage() const;
+
+        /*
+        * Choose what to do on contradictions, see Contradiction.
+        * @param mode the method to use
+        * @param maxBacktracks how many decisions could be undone before the collapse starts over
+        * @param maxRestarts how many times the collapse could start over, after that the rest of the field is solved with Fallback
+        */
+        void setContradiction( Contradiction mode, size_t maxBacktracks = 256, size_t maxRestarts = 8 );
+
+        /*
+        * Get the current contradiction handling method
+        */
+        Contradiction getContradiction() const;
+
+        /*
+        * The number of decisions undone (Contradiction::Backtrack) since the last init() or reset()
+        */
+        size_t getBacktracks() const;
+
+        /*
+        * The number of times the collapse started over (Contradiction::Backtrack) since the last init() or reset()
+        */
+        size_t getRestarts() const;
+
+        /*
+        * Get the solver counters, they stay zero unless C011APSY_STATS is defined
+        */
+        Stats getStats() const;
+
+        /*
+        * Start counting from zero, the same happens on init() and reset()
+        */
+        void resetStats();
+
+        /*
+        * Log the changed cells to a journal, see takeChanges(). Logging is just appending to a buffer,
+        * so it's a lot cheaper than a callback. Turning it off drops the changes logged so far
+        */
+        void setJournal( bool on );
+        bool getJournal() const;
+
+        /*
+        * Take the changes logged since the previous call, e.g. once per step or per frame.
+        * A cell may be logged several times, the last entry is the current one. The changes are dropped on reset()
+        * @param changes receives the changes, its old content is dropped. The buffers are swapped,
+        * so pass the same vector every time to avoid allocations
+        */
+        void takeChanges( std::vector<Change>& changes );
+
+        /*
+        * Set a callback that is called for every processed cell, same as the one passed to collapse(),
+        * but with a user data pointer
+        * @param observer the callback, nullptr to remove it
+        * @param context passed to the observer as is
+        */
+        void setObserver( Observer observer, void* context = nullptr );
+
+        /*
+        * Restrict some of the cells to the given tiles, e.g. to put the mandatory tiles or to set the borders.
+        * All the cells are restricted first and then the changes are propagated in a single pass, so it's a lot
+        * cheaper than editing getField() and taking a step for every cell. Call it after init() or reset(),
+        * as many times as needed. The restricted field is the starting point: the decisions made before can't be undone
+        * @param cells the cell ids, see getField()
+        * @param allowed the tiles allowed in each of the cells, getTiles().size() bits each
+        * @return false if some of the cells would have no tiles left, these are left as they were
+        */
+        bool constrain( const std::vector<size_t>& cells, const std::vector<Bitset>& allowed );
+
+        /*
+        * Place a tile in a cell before the generation, see constrain()
+        * @param x
+        * @param y the cell coordinates, y goes through all the layers if there are several
+        * @param tile the tile id, see getTiles()
+        */
+        bool fixTile( size_t x, size_t y, size_t tile );
+
+        /*
+        * Run the collapse process.
+        * @param onestep a flag that tells the Wave you only want one simulation step at a time. 
+        * If this parameter is true, you need to call this method until it returns true to obtain the final result
+        * @param callback a callback function, it will be called after each processed cell.
+        * Keep in mind it may take several steps to set a cell to its final value
+        */
+        bool collapse( bool oneStep, Callback c = nullptr );
+
+        /*
+        * Run the collapse process for a limited time. The work may stop in the middle of a step,
+        * the next call picks it up exactly where it stopped, so the result is the same as the one of collapse( false ).
+        * The time is checked every few cells, so expect it to be exceeded a bit
+        * @param budget how long to work
+        * @param callback see collapse()
+        * @return true when the field is solved
+        */
+        bool collapseFor( std::chrono::nanoseconds budget, Callback c = nullptr );
+
+        /*
+        * Save the solver state: the field, the random generator, the entropy index and the step in progress, if any,
+        * so the collapse could go on from here later, even in another process. The rules are not saved.
+        * @param incremental only save what's changed since the previous checkpoint, so it's cheap enough to take them often.
+        * The first checkpoint after init() or reset() is always a full one
+        * @return the checkpoint data, see restore()
+        */
+        std::vector<uint8_t> checkpoint( bool incremental = false );
+
+        /*
+        * Get back to a saved state. The Wave should have the same rules, field size and settings the checkpoint was taken with.
+        * A full checkpoint could be restored at any time. An incremental one is applied on top of the previous checkpoint
+        * of its chain, so it's only accepted right after that one was taken or restored, with no collapse in between.
+        * The journal and the output are not updated, see writeResult()
+        * @param data the checkpoint data
+        * @param size its size
+        * @return false if the data is not valid or doesn't fit the Wave's state, the Wave is left intact then
+        */
+        bool restore( const void* data, size_t size );
+
+        /*
+        * Run the whole collapse process on several threads, see setThreads().
+        * The field is split into square chunks. The one cell wide seams between the chunks are collapsed first,
+        * then every chunk is solved independently by a worker, with the seams around it as the boundary.
+        * The result depends on the random seed and the chunk size only, not on the number of threads
+        * @param chunkSize the chunk side, in cells, including one seam. Smaller chunks mean more seams to be solved serially
+        */
+        void collapseParallel( size_t chunkSize = 64 );
+
+        /*
+        * Solve the field as a piece of a bigger world. Normally everything outside the field could be anything,
+        * here the cells right outside are fixed by the neighbors, so the result fits them seamlessly.
+        * Call it on a fresh field (see reset()), same as collapse( false )
+        * @param borders the tiles of the neighbors, see Borders
+        */
+        void collapseChunk( const Borders& borders );
+
+        /*
+        * Reroll a rectangular region of the field. The cells inside are reopened and solved again,
+        * the cells around are left as they are and the new tiles fit them. Only the region is processed,
+        * so the cost depends on its area, not on the field size.
+        * @note meant for solved fields, the unsolved cells around the region are not updated
+        * @param x
+        * @param y the region's top-left corner
+        * @param width
+        * @param height region dimensions
+        * @param rndSeed a seed for the random generator, zero means a random one
+        */
+        void regenerateRegion( size_t x, size_t y, size_t width, size_t height, size_t rndSeed = 0 );
+
+        /*
+        * Generate a bunch of independent results with the same rules and dimensions, concurrently.
+        * Every thread keeps a single Wave and reuses it for all its jobs, see reset()
+        * @param rules the rules to share
+        * @param width
+        * @param height result dimensions
+        * @param seeds random seeds, one per result
+        * @param outputs buffers to write the results to, one per seed.
+        * Each one should hold width * height tiles, stored row-by-row, see getTiles()
+        * @param threads the number of threads to use, zero means all the hardware threads
+        * @param propagation the propagation method to use
+        */
+        static void generateBatch(
+            const RuleSetPtr& rules,
+            size_t width, size_t height,
+            const std::vector<size_t>& seeds,
+            const std::vector<T*>& outputs,
+            size_t threads = 0,
+            Propagation propagation = Bitsets );
+
+        /*
+        * Tell how much a generation would cost, without building the rules or the field.
+        * The tiles and their neighbors are only counted by the hashes, so the numbers are expected, not exact.
+        * See init() for the parameters
+        * @param width
+        * @param height result dimensions
+        */
+        static Estimate estimate(
+            const std::vector<T>& pattern,
+            size_t patternWidth, size_t patternHeight,
+            size_t tileWidth, size_t tileHeight,
+            size_t width, size_t height,
+            int patternWrap = NoWrap,
+            int symmetry = NoSymmetry );
+
+        /*
+        * Same as above, for the rules that are already known
+        */
+        static Estimate estimate( const Seed& seed, size_t width, size_t height );
+
+        /*
+        * Get the current operation progress, percent
+        * @note don't expect the progress to grow in a constant pace
+        */
+        float getProgress() const;
+
+        /*
+        * Build the initial Wave state from the rules. You may use this seed to iniitialize other waves, or edit it
+        * and pass it to init() to change the rules: the rules themselves are read-only. It's a fresh copy every time.
+        * @note use getRules() to share the rules with other Waves, and RuleSet::save() to store them
+        */
+        Seed buildSeed() const;
+
+        /*
+        * Get the rules this Wave is using
+        */
+        const RuleSetPtr& getRules() const;
+
+        /*
+        * Get the current field state.
+        * @note the field may be altered before the generation step, the wave will recount it
+        * when the next step starts. Use the const version to avoid that when only reading the field
+        */
+        Field& getField();
+        const Field& getField() const;
+
+        /*
+        * Get the tiles that were generated for this Wave
+        */
+        const std::vector<T>& getTiles() const;
+
+        /*
+        * Write the result to a buffer, every cell gets its tile (the first possible one, if it's not solved yet).
+        * The empty cells are left as they are
+        * @param out the buffer, getFieldHeight() * getFieldDepth() rows of getFieldWidth() tiles each, the layers go one after another
+        * @param stride the distance between the rows, bytes. Zero means the rows are tightly packed
+        */
+        void writeResult( T* out, size_t stride = 0 ) const;
+
+        /*
+        * Same as writeResult(), but the tile ids are written, see getTiles(). The empty cells get the number of tiles
+        */
+        void writeTileIds( uint32_t* out, size_t stride = 0 ) const;
+
+        /*
+        * Write the tiles to a buffer as soon as the cells are solved, so the result is ready right after the collapse.
+        * With Contradiction::Backtrack a cell may be written several times, the last one is the right one
+        * @param out the buffer, see writeResult(). nullptr stops the writing
+        * @param stride see writeResult()
+        */
+        void setOutput( T* out, size_t stride = 0 );
+
+        /*
+        * Field width
+        */
+        size_t getFieldWidth() const;
+
+        /*
+        * Field height
+        */
+        size_t getFieldHeight() const;
+
+        /*
+        * Field depth, the number of layers
+        */
+        size_t getFieldDepth() const;
+
+        /*
+        * Run the single step
+        * @param id0 the index of the cell that will be collapsed by force
+        * @param c callback
+        */
+        void collapseStep( size_t id0, Callback c );
+
+    private:
+        /*
+        * The benchmarks measure some of the internals directly, see bench/bench.cpp
+        */
+        friend struct WaveBenchmark;
+
+        using Clock = std::chrono::steady_clock;
+
+        /*
+        * The first part of collapseStep(): place a tile and schedule its propagation
+        */
+        void beginStep( size_t id0, Callback c );
+
+        /*
+        * The rest of collapseStep(): propagate the changes and resolve the contradictions
+        * @param deadline when to stop, nullptr means run until done
+        * @return false if the time ran out and the step is still pending
+        */
+        bool finishStep( Callback c, const Clock::time_point* deadline );
+
+        /*
+        * Perform the cell collapse. It uses the tiles' weights to determine which tile to place
+        * @param id the index of a cell to collapse
+        * @return the tile placed, or the tile count when the cell has no tiles left
+        */
+        size_t collapseCell( size_t id );
+
+        /*
+        * Check if the changes are logged to be undone later, see Contradiction::Backtrack
+        */
+        bool isRecording() const;
+
+        /*
+        * Log the cell state before it's changed (Propagation::Bitsets)
+        * @param id the cell to be changed
+        * @param words the cell content to log
+        */
+        void record( size_t id, const uint64_t* words );
+
+        /*
+        * Undo the logged changes, newest first, until only the given number is left
+        */
+        void undo( size_t trail );
+
+        /*
+        * Get rid of a contradiction found during the last step: undo the decisions, most recent first,
+        * and forbid the tiles they placed. Start over when it takes too long
+        */
+        void resolve( Callback c );
+
+        /*
+        * Remove a tile from a cell outside of the regular collapse and propagate the change
+        */
+        void banTile( size_t id, size_t tile, Callback c );
+
+        /*
+        * Forget the logged changes, they can't be undone anymore
+        */
+        void clearTrail();
+
+        /*
+        * Pick one of the tiles possible to place in a cell, the probability of each tile is proportional to its weight.
+        * Only the set bits are visited, no matter how large the weights are
+        */
+        size_t pickTile( ConstCell cell );
+
+        /*
+        * Check the cell current possible tiles, and its neighbors.
+        * Get the intersection of these sets and assign it to the cell.
+        * @param id the cell id to check
+        * @return the number of tiles left possible to place in the cell
+        */
+        size_t filterCandidates( size_t id );
+
+        /*
+        * Find the field cell with the lowest "enthropy".
+        */
+        size_t getCollapsePoint();
+
+        /*
+        * Assign the new number of possible tiles to a cell after it was changed,
+        * keeps the enthropy index and the total uncertainty up to date
+        */
+        void updateCount( size_t id, size_t count );
+
+        /*
+        * Tell the callback and the observer a cell was processed
+        */
+        void notify( Callback c, size_t id );
+
+        /*
+        * Pass a new count of a cell on to the journal and the output, see setJournal() and setOutput()
+        */
+        void logChange( size_t id, size_t count );
+
+        /*
+        * Read a cell without giving it its own memory, see Storage
+        */
+        ConstCell readCell( size_t id ) const;
+
+        /*
+        * Overwrite a cell with the content of another one
+        */
+        void storeCell( size_t id, ConstCell value );
+
+        /*
+        * Recount the whole field, used when the field could be changed from the outside (see getField())
+        */
+        void rebuildIndex();
+
+        /*
+        * The current state is the latest checkpoint now, start collecting the changes from here
+        */
+        void markCheckpoint();
+
+        /*
+        * Propagate the cell processing through the field: the unvisited neighbors are added to m_wavefront
+        * @param id0 the id of the cell to pass the processing from
+        */
+        void propagate( size_t id0 );
+
+        /*
+        * Process the cells in m_wavefront until there's nothing left to update (Propagation::Bitsets)
+        * @param deadline when to stop, the cells left stay in m_wavefront. nullptr means no limit
+        * @return false if the time ran out
+        */
+        bool propagateBitsets( Callback c, const Clock::time_point* deadline = nullptr );
+
+        /*
+        * Spread the changes of the cells in m_wavefront until nothing changes (Propagation::Bitsets).
+        * Unlike propagateBitsets() a cell is narrowed down again every time its neighbor changes, so the changes
+        * of any number of cells are spread at once. A cell that would run out of tiles is left as it was. See constrain()
+        */
+        void propagateConstraints();
+
+        /*
+        * Check if a cell doesn't need to be processed during the current step
+        */
+        bool isVisited( size_t id ) const;
+
+        /*
+        * Start a new step: forget all the visited cells
+        */
+        void beginVisit();
+
+        /*
+        * Remove a single tile from a cell and schedule the removal to be propagated (Propagation::Supports)
+        */
+        void removeTile( size_t id, size_t tile );
+
+        /*
+        * Process all the scheduled tile removals, decrementing the supports of the neighboring tiles
+        * and removing those that are not supported anymore (Propagation::Supports)
+        * @param deadline see propagateBitsets()
+        */
+        bool propagateSupports( Callback c, const Clock::time_point* deadline = nullptr );
+
+        /*
+        * Count the supports of each tile of each cell for the current field state,
+        * then remove the tiles which are not supported (Propagation::Supports)
+        */
+        void initSupports();
+
+        /*
+        * Count the supports from scratch and compare them to the ones initSupports() got, the debug builds only
+        */
+        bool supportsCounted();
+
+        /*
+        * Get the support counter of a tile inside a cell, for the given direction
+        */
+        uint16_t& support( size_t id, size_t tile, int dir );
+
+        /*
+        * Get the neighboring cell to a given one in a specific direction
+        * @param x
+        * @param y coordinates of a cell to get a neighbor of
+        * @param dir neighbor direction
+        */
+        ConstCell getNeighbor( size_t x, size_t y, int dir ) const;
+
+        /*
+        * Get the id of the neighboring cell to a given one in a specific direction
+        * @param id the cell to get a neighbor of
+        * @param dir neighbor direction
+        * @param[out] neighbor the neighbor id
+        * @return false when there's no neighbor, i.e. the cell is at the field boundary
+        * @note it's inlined, so with a constant direction the topology math is mostly resolved at compile time
+        */
+        bool getNeighborId( size_t id, int dir, size_t& neighbor ) const;
+
+        /*
+        * Helper, just reverse the direction
+        * Up <-> Down, Left <-> Right, the others are paired the same way
+        */
+        static int revDir( int dir );
+
+        /*
+        * Fill in the memory and the time figures of an estimate, the tiles and the neighbors are already counted
+        */
+        static void completeEstimate( Estimate& estimate, size_t width, size_t height );
+
+        /*
+        * Check if a cell belongs to the seams between the chunks, see collapseParallel()
+        */
+        bool isSeam( size_t x, size_t y, size_t chunkSize ) const;
+
+        /*
+        * Turn this wave into a copy of a rectangular region of another one, so the region could be solved independently.
+        * The buffers are reused, see reset()
+        * @param src the wave to copy from, the rules and the propagation method are taken from it too
+        * @param x
+        * @param y the region's top-left corner in src
+        * @param width
+        * @param height region dimensions
+        * @param random the random generator to solve the region with
+        */
+        void loadRegion( const Wave& src, size_t x, size_t y, size_t width, size_t height, const Random& random );
+
+        /*
+        * Take the rules and the settings of another wave, the field is left as it is
+        */
+        void copySettings( const Wave& src );
+
+        /*
+        * Collapse the field after its border cells were restricted from the outside, see collapseChunk()
+        */
+        void collapseRestricted();
+
+        /*
+        * Helper, get the field linear cell id from its coordinates
+        */
+        size_t fieldIndex( size_t x, size_t y ) const;
+
+        /*
+        * Initialize the random numbers generator, using m_rndSeed
+        */
+        void initRandom();
+
+        /*
+        * Initialize the field and helper structures
+        */
+        void initField();
+
+        /*
+        * Fill the field with all the tiles possible and forget the previous run, the buffers are reused
+        */
+        void resetField();
+
+        /*
+        * Prepare the data the current propagation method needs, see RuleSet::compileSupports()
+        */
+        void initAdjacency();
+
+        /*
+        * Add the counters of a helper wave to the ones of this wave
+        */
+        void mergeStats( const Stats& other );
+
+    private:
+        RuleSetPtr m_rules;
+        size_t m_rndSeed;
+        std::vector<TileSet> m_possibleNeighbors; /// this is used in filterCandidates()
+        Random m_random;
+        Field m_field;
+        std::vector<uint32_t> m_visited; /// the cell is visited during the current step if its value is m_visitEpoch
+        std::vector<bool> m_collapsed; /// store cells that are solved, i.e. has only one tile
+        std::vector<uint32_t> m_wavefront; /// the queue of the cells to be processed within a step, reused between steps
+        size_t m_wavefrontHead; /// the next cell to be processed in m_wavefront
+        uint32_t m_visitEpoch;
+        EntropyIndex m_entropy; /// number of possible tiles for each cell, grouped by value
+        size_t m_fieldW;
+        size_t m_fieldH;
+        size_t m_fieldD; /// the number of layers, see setDepth()
+        int m_wrap; /// the field edges that touch each other, see Wrap
+        size_t m_uncertaintyCurrent; /// total number of tiles still possible to place on the field
+        bool m_indexDirty; /// the field was exposed via getField() and needs to be recounted
+        bool m_stepPending; /// collapseFor() ran out of time in the middle of a step
+
+        Propagation m_propagation;
+        std::vector<uint16_t> m_supports; /// [(cell * tiles + tile) * Directions + dir] is the number of neighbor's tiles that allow this tile
+        std::vector<std::pair<uint32_t, uint32_t>> m_removals; /// removed tiles (cell, tile) to be propagated
+
+        size_t m_threads;
+
+        bool m_journal; /// log the changes to m_changes, see setJournal()
+        std::vector<Change> m_changes;
+        Observer m_observer;
+        void* m_observerContext;
+        T* m_output; /// the solved cells go there, see setOutput()
+        size_t m_outputStride; /// bytes, zero means the rows are tightly packed
+
+        /*
+        * A tile placed on purpose, see collapseStep()
+        */
+        struct Decision
+        {
+            uint32_t cell;
+            uint32_t tile;
+            size_t trail; /// m_trail size before the decision
+        };
+
+        Contradiction m_contradiction;
+        size_t m_maxBacktracks;
+        size_t m_maxRestarts;
+        bool m_conflict; /// a cell ran out of tiles during the current step
+        bool m_gaveUp; /// too many restarts, the contradictions are handled as Contradiction::Fallback
+        size_t m_backtracks;
+        size_t m_restarts;
+        size_t m_runBacktracks; /// backtracks since the last restart
+        std::vector<Decision> m_decisions;
+        std::vector<std::pair<uint32_t, uint32_t>> m_trail; /// changed cells: (cell, removed tile) for Supports, (cell, 0) for Bitsets
+        std::vector<uint64_t> m_trailWords; /// the old content of the cells in m_trail, Propagation::Bitsets only
+        std::vector<uint64_t> m_snapshot; /// the cell content before filterCandidates()
+
+        std::unique_ptr<Wave> m_region; /// the helper wave for regenerateRegion(), created on demand
+
+        uint64_t m_chain; /// the checkpoint chain the state belongs to, zero if no checkpoint was taken since reset()
+        uint64_t m_sequence; /// the latest checkpoint in the chain
+        bool m_changed; /// there were changes since the latest checkpoint
+        CellSet m_dirty; /// the cells changed since the latest checkpoint, collected while m_chain is set
+        size_t m_trailMark; /// m_trail entries saved by the latest checkpoint and not undone since then
+        size_t m_decisionsMark; /// same for m_decisions
+
+        C011APSY_STAT( Stats m_stats; )
+    };
+
+    /*
+    * Generates an unbounded world, a chunk at a time. Every chunk is generated on demand
+    * and fits the neighbors that are loaded at the moment, see Wave::collapseChunk().
+    * Only the loaded chunks are kept, so the memory doesn't depend on the world size
+    */
+    template<class T, size_t MaxTiles = 0>
+    class ChunkGenerator
+    {
+    public:
+        using WaveType = Wave<T, MaxTiles>;
+
+        /*
+        * Tile ids of a chunk, stored row-by-row, see getTiles()
+        */
+        using Chunk = std::vector<uint32_t>;
+
+        /*
+        * Constructor
+        * @param rules the rules to generate the world with
+        * @param chunkWidth
+        * @param chunkHeight chunk dimensions
+        * @param worldSeed the seed every chunk's random seed is derived from. Zero means random
+        */
+        ChunkGenerator( typename WaveType::RuleSetPtr rules, size_t chunkWidth, size_t chunkHeight, size_t worldSeed = 0 );
+
+        /*
+        * Choose the propagation method for the chunks generated after this call
+        */
+        void setPropagation( typename WaveType::Propagation mode );
+
+        /*
+        * Choose how the chunk's field is stored while it's generated, see Wave::setStorage()
+        */
+        void setStorage( typename WaveType::Storage mode );
+
+        /*
+        * Choose what to do on contradictions, see Wave::setContradiction()
+        */
+        void setContradiction( typename WaveType::Contradiction mode, size_t maxBacktracks = 256, size_t maxRestarts = 8 );
+
+        /*
+        * Get a chunk, it's generated on the first request
+        * @param x
+        * @param y chunk coordinates, (x + 1, y) is the chunk to the right, (x, y + 1) is the one below
+        */
+        const Chunk& load( int32_t x, int32_t y );
+
+        /*
+        * Get a chunk if it's loaded
+        * @return nullptr when the chunk is not loaded
+        */
+        const Chunk* find( int32_t x, int32_t y ) const;
+
+        /*
+        * Forget a chunk. It will be generated again on the next request, probably different
+        */
+        void release( int32_t x, int32_t y );
+
+        /*
+        * Number of chunks currently loaded
+        */
+        size_t getLoadedCount() const;
+
+        const std::vector<T>& getTiles() const;
+        size_t getChunkWidth() const;
+        size_t getChunkHeight() const;
+
+    private:
+        static uint64_t key( int32_t x, int32_t y );
+
+    private:
+        WaveType m_wave; /// the chunk currently being generated, reused for every chunk
+        typename WaveType::Borders m_borders;
+        std::unordered_map<uint64_t, Chunk> m_chunks;
+        size_t m_worldSeed;
+    };
+
+    namespace detail
+    {
+        inline
+        uint64_t rotl( uint64_t n, int bits )
+        {
+            return (n << bits) | (n >> (64 - bits));
+        }
+
+        inline
+        uint64_t mul128( uint64_t a, uint64_t b, uint64_t& high )
+        {
+#if defined( __SIZEOF_INT128__ )
+            __extension__ typedef unsigned __int128 Product;
+            const Product product = static_cast<Product>( a ) * b;
+            high = static_cast<uint64_t>( product >> 64 );
+            return static_cast<uint64_t>( product );
+#elif defined( _MSC_VER ) && defined( _M_X64 )
+            return _umul128( a, b, &high );
+#else
+            const uint64_t lowLow = (a & 0xffffffffull) * (b & 0xffffffffull);
+            const uint64_t lowHigh = (a & 0xffffffffull) * (b >> 32);
+            const uint64_t highLow = (a >> 32) * (b & 0xffffffffull);
+            const uint64_t middle = (lowLow >> 32) + (lowHigh & 0xffffffffull) + (highLow & 0xffffffffull);
+            high = (a >> 32) * (b >> 32) + (lowHigh >> 32) + (highLow >> 32) + (middle >> 32);
+            return (middle << 32) | (lowLow & 0xffffffffull);
+#endif
+        }
+
+        inline
+        uint64_t splitMix64( uint64_t& state )
+        {
+            uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            return z ^ (z >> 31);
+        }
+
+        template<class Rnd>
+        uint64_t bounded( Rnd& rnd, uint64_t range )
+        {
+            static_assert( Rnd::min() == 0 && Rnd::max() == UINT64_MAX, "detail::bounded() needs uint64_t over the whole range" );
+
+            uint64_t high;
+            uint64_t low = mul128( rnd(), range, high );
+            if ( low < range )
+            {
+                // a few of the low values would make some of the results more likely, these are drawn again
+                const uint64_t threshold = (0 - range) % range;
+                while ( low < threshold )
+                {
+                    low = mul128( rnd(), range, high );
+                }
+            }
+            return high;
+        }
+
+        template<class Rnd>
+        double unitReal( Rnd& rnd )
+        {
+            return static_cast<double>( rnd() >> 11 ) * (1.0 / 9007199254740992.0);
+        }
+
+        template<class Rnd>
+        Rnd splitRandom( const Rnd& rnd, uint64_t stream )
+        {
+            Rnd copy( rnd );
+            uint64_t state = static_cast<uint64_t>( copy() ) ^ splitMix64( stream );
+            return Rnd( splitMix64( state ) );
+        }
+
+        inline
+        Xoshiro256 splitRandom( const Xoshiro256& rnd, uint64_t stream )
+        {
+            return rnd.split( stream );
+        }
+
+        inline
+        int popcount( uint64_t n )
+        {
+#if defined( __GNUC__ ) || defined( __clang__ )
+            return __builtin_popcountll( n );
+#elif defined( _MSC_VER ) && defined( _M_X64 ) && defined( __AVX__ )
+            return static_cast<int>( __popcnt64( n ) );
+#else
+            n = n - ((n >> 1) & 0x5555555555555555ull);
+            n = (n & 0x3333333333333333ull) + ((n >> 2) & 0x3333333333333333ull);
+            n = (n + (n >> 4)) & 0x0f0f0f0f0f0f0f0full;
+            return static_cast<int>( (n * 0x0101010101010101ull) >> 56 );
+#endif
+        }
+
+        inline
+        int ctz( uint64_t n )
+        {
+            assert( n && "detail::ctz() zero argument" );
+#if defined( __GNUC__ ) || defined( __clang__ )
+            return __builtin_ctzll( n );
+#elif defined( _MSC_VER ) && defined( _M_X64 )
+            unsigned long index;
+            _BitScanForward64( &index, n );
+            return static_cast<int>( index );
+#else
+            int result = 0;
+            if ( (n & 0xffffffffull) == 0 ) { result += 32; n >>= 32; }
+            if ( (n & 0xffffull) == 0 ) { result += 16; n >>= 16; }
+            if ( (n & 0xffull) == 0 ) { result += 8; n >>= 8; }
+            if ( (n & 0xfull) == 0 ) { result += 4; n >>= 4; }
+            if ( (n & 0x3ull) == 0 ) { result += 2; n >>= 2; }
+            return result + static_cast<int>( (n & 0x1) == 0 );
+#endif
+        }
+
+        inline
+        size_t wordCount( size_t bits )
+        {
+            return bits / 64 + (bits % 64 > 0);
+        }
+
+        inline
+        void fill( uint64_t* dst, size_t words, size_t bits, bool on )
+        {
+            // the words past the significant bits are always kept clear
+            for ( size_t i = 0; i < words; ++i )
+            {
+                const size_t low = i * 64;
+                if ( !on || bits <= low )
+                {
+                    dst[i] = 0;
+                }
+                else
+                {
+                    dst[i] = bits - low >= 64 ? ~uint64_t( 0 ) : ~uint64_t( 0 ) >> (64 - (bits - low));
+                }
+            }
+        }
+
+        inline
+        void intersect( uint64_t* dst, const uint64_t* src, size_t words )
+        {
+            size_t i = 0;
+#if defined( C011APSY_AVX512 )
+            for ( ; i + 8 <= words; i += 8 )
+            {
+                const __m512i a = _mm512_loadu_si512( dst + i );
+                const __m512i b = _mm512_loadu_si512( src + i );
+                _mm512_storeu_si512( dst + i, _mm512_and_si512( a, b ) );
+            }
+#endif
+#if defined( C011APSY_AVX2 )
+            for ( ; i + 4 <= words; i += 4 )
+            {
+                const __m256i a = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( dst + i ) );
+                const __m256i b = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( src + i ) );
+                _mm256_storeu_si256( reinterpret_cast<__m256i*>( dst + i ), _mm256_and_si256( a, b ) );
+            }
+#elif defined( C011APSY_NEON )
+            for ( ; i + 2 <= words; i += 2 )
+            {
+                vst1q_u64( dst + i, vandq_u64( vld1q_u64( dst + i ), vld1q_u64( src + i ) ) );
+            }
+#endif
+            for ( ; i < words; ++i )
+            {
+                dst[i] &= src[i];
+            }
+        }
+
+        inline
+        void add( uint64_t* dst, const uint64_t* src, size_t words )
+        {
+            size_t i = 0;
+#if defined( C011APSY_AVX512 )
+            for ( ; i + 8 <= words; i += 8 )
+            {
+                const __m512i a = _mm512_loadu_si512( dst + i );
+                const __m512i b = _mm512_loadu_si512( src + i );
+                _mm512_storeu_si512( dst + i, _mm512_or_si512( a, b ) );
+            }
+#endif
+#if defined( C011APSY_AVX2 )
+            for ( ; i + 4 <= words; i += 4 )
+            {
+                const __m256i a = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( dst + i ) );
+                const __m256i b = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( src + i ) );
+                _mm256_storeu_si256( reinterpret_cast<__m256i*>( dst + i ), _mm256_or_si256( a, b ) );
+            }
+#elif defined( C011APSY_NEON )
+            for ( ; i + 2 <= words; i += 2 )
+            {
+                vst1q_u64( dst + i, vorrq_u64( vld1q_u64( dst + i ), vld1q_u64( src + i ) ) );
+            }
+#endif
+            for ( ; i < words; ++i )
+            {
+                dst[i] |= src[i];
+            }
+        }
+
+        inline
+        bool empty( const uint64_t* src, size_t words )
+        {
+            uint64_t any = 0;
+            for ( size_t i = 0; i < words; ++i )
+            {
+                any |= src[i];
+            }
+            return any == 0;
+        }
+
+        inline
+        size_t count( const uint64_t* src, size_t words )
+        {
+            size_t result = 0;
+            size_t i = 0;
+#if defined( C011APSY_AVX512_POPCNT )
+            __m512i acc = _mm512_setzero_si512();
+            for ( ; i + 8 <= words; i += 8 )
+            {
+                acc = _mm512_add_epi64( acc, _mm512_popcnt_epi64( _mm512_loadu_si512( src + i ) ) );
+            }
+            result = static_cast<size_t>( _mm512_reduce_add_epi64( acc ) );
+#endif
+            for ( ; i < words; ++i )
+            {
+                result += popcount( src[i] );
+            }
+            return result;
+        }
+
+        inline
+        size_t intersectCount( uint64_t* dst, const uint64_t* src, size_t words )
+        {
+            size_t result = 0;
+            size_t i = 0;
+#if defined( C011APSY_AVX512_POPCNT )
+            __m512i acc = _mm512_setzero_si512();
+            for ( ; i + 8 <= words; i += 8 )
+            {
+                const __m512i n = _mm512_and_si512( _mm512_loadu_si512( dst + i ), _mm512_loadu_si512( src + i ) );
+                _mm512_storeu_si512( dst + i, n );
+                acc = _mm512_add_epi64( acc, _mm512_popcnt_epi64( n ) );
+            }
+            result = static_cast<size_t>( _mm512_reduce_add_epi64( acc ) );
+#endif
+            for ( ; i < words; ++i )
+            {
+                dst[i] &= src[i];
+                result += popcount( dst[i] );
+            }
+            return result;
+        }
+
+        inline
+        bool intersectChanged( uint64_t* dst, const uint64_t* src, size_t words )
+        {
+            uint64_t removed = 0;
+            for ( size_t i = 0; i < words; ++i )
+            {
+                removed |= dst[i] & ~src[i];
+                dst[i] &= src[i];
+            }
+            return removed != 0;
+        }
+
+        inline
+        bool single( const uint64_t* src, size_t words )
+        {
+            bool result = false;
+            for ( size_t i = 0; i < words; ++i )
+            {
+                const uint64_t n = src[i];
+                if ( n )
+                {
+                    if ( result || (n & (n - 1)) )
+                    {
+                        return false;
+                    }
+                    result = true;
+                }
+            }
+            return result;
+        }
+
+        inline
+        size_t first( const uint64_t* src, size_t words, size_t bits )
+        {
+            for ( size_t i = 0; i < words; ++i )
+            {
+                if ( src[i] )
+                {
+                    return i * 64 + ctz( src[i] );
+                }
+            }
+            return bits;
+        }
+
+        template<class F>
+        void forEach( const uint64_t* src, size_t words, F&& f )
+        {
+            for ( size_t i = 0; i < words; ++i )
+            {
+                uint64_t n = src[i];
+                while ( n )
+                {
+                    f( i * 64 + ctz( n ) );
+                    n &= (n - 1);
+                }
+            }
+        }
+
+        inline
+        uint64_t hashBytes( const void* data, size_t size )
+        {
+            // FNV-1a followed by the murmur3 finalizer
+            const uint8_t* bytes = static_cast<const uint8_t*>( data );
+            uint64_t h = 0xcbf29ce484222325ull;
+            for ( size_t i = 0; i < size; ++i )
+            {
+                h ^= bytes[i];
+                h *= 0x100000001b3ull;
+            }
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdull;
+            h ^= h >> 33;
+            h *= 0xc4ceb9fe1a85ec53ull;
+            h ^= h >> 33;
+            return h;
+        }
+
+        inline
+        std::vector<uint64_t> windowHashes(
+            const std::vector<uint64_t>& hashes,
+            size_t width, size_t height,
+            size_t windowWidth, size_t windowHeight )
+        {
+            assert( windowWidth <= width && windowHeight <= height && "detail::windowHashes() window is too large" );
+
+            const size_t cols = width - windowWidth + 1;
+            const size_t rows = height - windowHeight + 1;
+            std::vector<uint64_t> result( cols * rows, 0 );
+
+            if ( windowWidth == 0 || windowHeight == 0 )
+            {
+                return result;
+            }
+
+            uint64_t rowTop = 1;
+            for ( size_t i = 1; i < windowWidth; ++i )
+            {
+                rowTop *= HashRowBase;
+            }
+            uint64_t colTop = 1;
+            for ( size_t i = 1; i < windowHeight; ++i )
+            {
+                colTop *= HashColBase;
+            }
+
+            // horizontal pass: the hash of each windowWidth-long row segment
+            std::vector<uint64_t> segments( cols * height );
+            for ( size_t y = 0; y < height; ++y )
+            {
+                const uint64_t* row = &hashes[y * width];
+                uint64_t h = 0;
+                for ( size_t x = 0; x < windowWidth; ++x )
+                {
+                    h = h * HashRowBase + row[x];
+                }
+                segments[y * cols] = h;
+
+                for ( size_t x = 1; x < cols; ++x )
+                {
+                    h = (h - row[x - 1] * rowTop) * HashRowBase + row[x + windowWidth - 1];
+                    segments[y * cols + x] = h;
+                }
+            }
+
+            // vertical pass: combine windowHeight segments
+            for ( size_t x = 0; x < cols; ++x )
+            {
+                uint64_t h = 0;
+                for ( size_t y = 0; y < windowHeight; ++y )
+                {
+                    h = h * HashColBase + segments[y * cols + x];
+                }
+                result[x] = h;
+
+                for ( size_t y = 1; y < rows; ++y )
+                {
+                    h = (h - segments[(y - 1) * cols + x] * colTop) * HashColBase + segments[(y + windowHeight - 1) * cols + x];
+                    result[y * cols + x] = h;
+                }
+            }
+
+            return result;
+        }
+
+        template<class F>
+        void parallelFor( size_t count, size_t threads, F&& f )
+        {
+            threads = std::max<size_t>( 1, std::min( threads, count ) );
+            if ( threads == 1 )
+            {
+                if ( count )
+                {
+                    f( size_t( 0 ), count );
+                }
+                return;
+            }
+
+            std::vector<std::thread> workers;
+            workers.reserve( threads - 1 );
+
+            const size_t chunk = count / threads;
+            const size_t rest = count % threads;
+            size_t begin = 0;
+
+            for ( size_t i = 0; i < threads; ++i )
+            {
+                const size_t end = begin + chunk + (i < rest);
+                if ( i + 1 < threads )
+                {
+                    workers.emplace_back( [&f, begin, end]() { f( begin, end ); } );
+                }
+                else
+                {
+                    f( begin, end );
+                }
+                begin = end;
+            }
+
+            for ( auto& worker : workers )
+            {
+                worker.join();
+            }
+        }
+
+        inline
+        std::vector<Transform> symmetryTransforms( bool rotations, bool reflections, bool square )
+        {
+            std::vector<Transform> result;
+            for ( int i = 0; i < 8; ++i )
+            {
+                const Transform t = { (i & 4) != 0, (i & 2) != 0, (i & 1) != 0 };
+                // the rotations are the ones with an even number of the flags, the mirrors don't swap
+                const bool rotation = ((i ^ (i >> 1) ^ (i >> 2)) & 1) == 0;
+                const bool allowed = i == 0
+                    || (rotations && reflections)
+                    || (rotations && rotation)
+                    || (reflections && !t.swap);
+                if ( allowed && (square || !t.swap) )
+                {
+                    result.push_back( t );
+                }
+            }
+            return result;
+        }
+
+        inline
+        size_t transformedOffset( Transform t, size_t stride, size_t tileWidth, size_t tileHeight, size_t x, size_t y )
+        {
+            size_t sx = t.swap ? y : x;
+            size_t sy = t.swap ? x : y;
+            if ( t.flipX )
+            {
+                sx = tileWidth - 1 - sx;
+            }
+            if ( t.flipY )
+            {
+                sy = tileHeight - 1 - sy;
+            }
+            return sy * stride + sx;
+        }
+
+        inline
+        uint64_t transformedHash(
+            const uint64_t* hashes, size_t stride,
+            size_t tileWidth, size_t tileHeight, Transform t,
+            size_t x, size_t y, size_t width, size_t height )
+        {
+            // same as windowHashes(), the rows first
+            uint64_t h = 0;
+            for ( size_t i = 0; i < height; ++i )
+            {
+                uint64_t row = 0;
+                for ( size_t j = 0; j < width; ++j )
+                {
+                    row = row * HashRowBase + hashes[transformedOffset( t, stride, tileWidth, tileHeight, x + j, y + i )];
+                }
+                h = h * HashColBase + row;
+            }
+            return h;
+        }
+
+        template<int I, int Count>
+        struct Unroll
+        {
+            template<class F>
+            static void run( F& f )
+            {
+                f( I );
+                Unroll<I + 1, Count>::run( f );
+            }
+        };
+
+        template<int Count>
+        struct Unroll<Count, Count>
+        {
+            template<class F>
+            static void run( F& )
+            {
+            }
+        };
+
+        template<int Count, class F>
+        void unroll( F&& f )
+        {
+            Unroll<0, Count>::run( f );
+        }
+
+        inline
+        ScopedTimer::ScopedTimer( std::chrono::duration<double, std::milli>& total )
+            : m_total( total )
+            , m_start( std::chrono::steady_clock::now() )
+        {
+        }
+
+        inline
+        ScopedTimer::~ScopedTimer()
+        {
+            m_total += std::chrono::steady_clock::now() - m_start;
+        }
+
+        template<class T>
+        std::vector<T> wrapPattern( const std::vector<T>& pattern, size_t& width, size_t& height, size_t extraWidth, size_t extraHeight )
+        {
+            const size_t wrappedWidth = width + extraWidth;
+            const size_t wrappedHeight = height + extraHeight;
+
+            std::vector<T> wrapped;
+            wrapped.reserve( wrappedWidth * wrappedHeight );
+            for ( size_t y = 0; y < wrappedHeight; ++y )
+            {
+                for ( size_t x = 0; x < wrappedWidth; ++x )
+                {
+                    wrapped.push_back( pattern[(y % height) * width + x % width] );
+                }
+            }
+
+            width = wrappedWidth;
+            height = wrappedHeight;
+            return wrapped;
+        }
+
+        template<class X>
+        void append( std::vector<uint8_t>& out, const X* values, size_t count )
+        {
+            static_assert( std::is_trivially_copyable<X>::value, "detail::append() the values should be trivially copyable" );
+
+            const size_t pos = out.size();
+            out.resize( pos + count * sizeof( X ) );
+            if ( count )
+            {
+                memcpy( &out[pos], values, count * sizeof( X ) );
+            }
+        }
+
+        template<class X>
+        bool ByteReader::read( X* values, size_t count )
+        {
+            static_assert( std::is_trivially_copyable<X>::value, "ByteReader::read() the values should be trivially copyable" );
+
+            // the count may come from the data too, keep it from overflowing
+            const uint8_t* src = count <= (m_size - m_pos) / sizeof( X ) ? skip( count * sizeof( X ) ) : nullptr;
+            if ( !src )
+            {
+                return false;
+            }
+            if ( count )
+            {
+                memcpy( values, src, count * sizeof( X ) );
+            }
+            return true;
+        }
+
+        inline
+        const uint8_t* ByteReader::skip( size_t bytes )
+        {
+            if ( bytes > m_size - m_pos )
+            {
+                return nullptr;
+            }
+            const uint8_t* src = m_data + m_pos;
+            m_pos += bytes;
+            return src;
+        }
+    }
+
+    inline
+    std::shared_ptr<const void> mapFile( const std::string& path, size_t& size )
+    {
+#if defined( C011APSY_MMAP_POSIX )
+        const int fd = open( path.c_str(), O_RDONLY );
+        if ( fd < 0 )
+        {
+            return nullptr;
+        }
+
+        struct stat info;
+        void* data = MAP_FAILED;
+        if ( fstat( fd, &info ) == 0 && info.st_size > 0 )
+        {
+            size = static_cast<size_t>( info.st_size );
+            data = mmap( nullptr, size, PROT_READ, MAP_SHARED, fd, 0 );
+        }
+        // the mapping stays valid without the descriptor
+        close( fd );
+
+        if ( data == MAP_FAILED )
+        {
+            return nullptr;
+        }
+        const size_t mapped = size;
+        return std::shared_ptr<const void>( data, [mapped]( const void* p ) { munmap( const_cast<void*>( p ), mapped ); } );
+#elif defined( C011APSY_MMAP_WIN32 )
+        HANDLE file = CreateFileA( path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+        if ( file == INVALID_HANDLE_VALUE )
+        {
+            return nullptr;
+        }
+
+        LARGE_INTEGER fileSize;
+        HANDLE mapping = nullptr;
+        if ( GetFileSizeEx( file, &fileSize ) && fileSize.QuadPart > 0 )
+        {
+            size = static_cast<size_t>( fileSize.QuadPart );
+            mapping = CreateFileMappingA( file, nullptr, PAGE_READONLY, 0, 0, nullptr );
+        }
+        CloseHandle( file );
+
+        // the view keeps the mapping object alive
+        const void* data = mapping ? MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 ) : nullptr;
+        if ( mapping )
+        {
+            CloseHandle( mapping );
+        }
+
+        if ( !data )
+        {
+            return nullptr;
+        }
+        return std::shared_ptr<const void>( data, []( const void* p ) { UnmapViewOfFile( p ); } );
+#else
+        std::ifstream file( path, std::ios::binary | std::ios::ate );
+        if ( !file )
+        {
+            return nullptr;
+        }
+
+        size = static_cast<size_t>( file.tellg() );
+        file.seekg( 0 );
+
+        // uint64_t keeps the content aligned for the in-place use
+        auto buffer = std::make_shared<std::vector<uint64_t>>( (size + sizeof( uint64_t ) - 1) / sizeof( uint64_t ) );
+        if ( !file.read( reinterpret_cast<char*>( buffer->data() ), size ) )
+        {
+            return nullptr;
+        }
+        return std::shared_ptr<const void>( buffer, buffer->data() );
+#endif
+    }
+
+    template<size_t W>
+    BasicConstBitsetView<W>::BasicConstBitsetView( const uint64_t* data, size_t size )
+        : m_data( data )
+        , m_size( size )
+    {
+        assert( (W == 0 || size <= W * 64) && "BasicConstBitsetView size exceeds the capacity" );
+    }
+
+    template<size_t W>
+    bool BasicConstBitsetView<W>::operator[]( size_t index ) const
+    {
+        assert( index < m_size && "BasicConstBitsetView::operator[] index out of bounds" );
+        return (m_data[index / 64] >> (index % 64)) & 0x1;
+    }
+
+    template<size_t W>
+    bool BasicConstBitsetView<W>::empty() const
+    {
+        return detail::empty( m_data, words() );
+    }
+
+    template<size_t W>
+    size_t BasicConstBitsetView<W>::count() const
+    {
+        return detail::count( m_data, words() );
+    }
+
+    template<size_t W>
+    bool BasicConstBitsetView<W>::single() const
+    {
+        return detail::single( m_data, words() );
+    }
+
+    template<size_t W>
+    size_t BasicConstBitsetView<W>::first() const
+    {
+        return detail::first( m_data, words(), m_size );
+    }
+
+    template<size_t W>
+    BasicBitsetView<W>::BasicBitsetView( uint64_t* data, size_t size )
+        : m_data( data )
+        , m_size( size )
+    {
+        assert( (W == 0 || size <= W * 64) && "BasicBitsetView size exceeds the capacity" );
+    }
+
+    template<size_t W>
+    bool BasicBitsetView<W>::operator[]( size_t index ) const
+    {
+        assert( index < m_size && "BasicBitsetView::operator[] index out of bounds" );
+        return (m_data[index / 64] >> (index % 64)) & 0x1;
+    }
+
+    template<size_t W>
+    void BasicBitsetView<W>::set( size_t index, bool on ) const
+    {
+        assert( index < m_size && "BasicBitsetView::set() index out of bounds" );
+
+        const uint64_t mask = uint64_t( 1 ) << (index % 64);
+        if ( on )
+        {
+            m_data[index / 64] |= mask;
+        }
+        else
+        {
+            m_data[index / 64] &= (~mask);
+        }
+    }
+
+    template<size_t W>
+    void BasicBitsetView<W>::reset( bool on ) const
+    {
+        detail::fill( m_data, words(), m_size, on );
+    }
+
+    template<size_t W>
+    void BasicBitsetView<W>::intersect( BasicConstBitsetView<W> other ) const
+    {
+        assert( other.size() == m_size && "BasicBitsetView::intersect() size mismatch" );
+        detail::intersect( m_data, other.data(), words() );
+    }
+
+    template<size_t W>
+    size_t BasicBitsetView<W>::intersectCount( BasicConstBitsetView<W> other ) const
+    {
+        assert( other.size() == m_size && "BasicBitsetView::intersectCount() size mismatch" );
+        return detail::intersectCount( m_data, other.data(), words() );
+    }
+
+    template<size_t W>
+    bool BasicBitsetView<W>::intersectChanged( BasicConstBitsetView<W> other ) const
+    {
+        assert( other.size() == m_size && "BasicBitsetView::intersectChanged() size mismatch" );
+        return detail::intersectChanged( m_data, other.data(), words() );
+    }
+
+    template<size_t W>
+    void BasicBitsetView<W>::add( BasicConstBitsetView<W> other ) const
+    {
+        assert( other.size() == m_size && "BasicBitsetView::add() size mismatch" );
+        detail::add( m_data, other.data(), words() );
+    }
+
+    template<size_t W>
+    bool BasicBitsetView<W>::empty() const
+    {
+        return detail::empty( m_data, words() );
+    }
+
+    template<size_t W>
+    size_t BasicBitsetView<W>::count() const
+    {
+        return detail::count( m_data, words() );
+    }
+
+    template<size_t W>
+    bool BasicBitsetView<W>::single() const
+    {
+        return detail::single( m_data, words() );
+    }
+
+    template<size_t W>
+    size_t BasicBitsetView<W>::first() const
+    {
+        return detail::first( m_data, words(), m_size );
+    }
+
+    inline
+    Bitset::Bitset( size_t size, bool on )
+        : m_data( detail::wordCount( size ) )
+        , m_size( size )
+    {
+        detail::fill( m_data.data(), m_data.size(), m_size, on );
+    }
+
+    inline
+    bool Bitset::operator[]( size_t index ) const
+    {
+        assert( index < m_size && "Bitset::operator[] index out of bounds" );
+        return (m_data[index / 64] >> (index % 64)) & 0x1;
+    }
+
+    inline
+    void Bitset::set( size_t index, bool on )
+    {
+        assert( index < m_size && "Bitset::set() index out of bounds" );
+        view().set( index, on );
+    }
+
+    inline
+    void Bitset::reset( bool on )
+    {
+        detail::fill( m_data.data(), m_data.size(), m_size, on );
+    }
+
+    inline
+    void Bitset::intersect( ConstBitsetView other )
+    {
+        assert( other.size() == m_size && "Bitset::intersect() size mismatch" );
+        detail::intersect( m_data.data(), other.data(), m_data.size() );
+    }
+
+    inline
+    size_t Bitset::intersectCount( ConstBitsetView other )
+    {
+        assert( other.size() == m_size && "Bitset::intersectCount() size mismatch" );
+        return detail::intersectCount( m_data.data(), other.data(), m_data.size() );
+    }
+
+    inline
+    bool Bitset::intersectChanged( ConstBitsetView other )
+    {
+        assert( other.size() == m_size && "Bitset::intersectChanged() size mismatch" );
+        return detail::intersectChanged( m_data.data(), other.data(), m_data.size() );
+    }
+
+    inline
+    void Bitset::add( ConstBitsetView other )
+    {
+        assert( other.size() == m_size && "Bitset::add() size mismatch" );
+        detail::add( m_data.data(), other.data(), m_data.size() );
+    }
+
+    inline
+    bool Bitset::empty() const
+    {
+        return detail::empty( m_data.data(), m_data.size() );
+    }
+
+    inline
+    size_t Bitset::count() const
+    {
+        return detail::count( m_data.data(), m_data.size() );
+    }
+
+    inline
+    bool Bitset::single() const
+    {
+        return detail::single( m_data.data(), m_data.size() );
+    }
+
+    inline
+    size_t Bitset::first() const
+    {
+        return detail::first( m_data.data(), m_data.size(), m_size );
+    }
+
+    template<size_t W>
+    FixedBitset<W>::FixedBitset( size_t size, bool on )
+        : m_size( size )
+    {
+        assert( size <= W * 64 && "FixedBitset size exceeds the capacity" );
+        detail::fill( m_data.data(), W, m_size, on );
+    }
+
+    template<size_t W>
+    BasicBitsetArray<W>::BasicBitsetArray( const BasicBitsetArray& other )
+    {
+        *this = other;
+    }
+
+    template<size_t W>
+    BasicBitsetArray<W>& BasicBitsetArray<W>::operator=( const BasicBitsetArray& other )
+    {
+        if ( this != &other )
+        {
+            m_compact = false;
+            if ( other.m_compact )
+            {
+                m_storage.clear();
+                m_data = nullptr;
+                m_count = other.m_count;
+                m_bits = other.m_bits;
+            }
+            else
+            {
+                assign( other.m_count, other.m_bits, false );
+                std::copy( other.m_data, other.m_data + m_count * stride(), m_data );
+            }
+
+            m_compact = other.m_compact;
+            m_slots = other.m_slots;
+            m_blocks = other.m_blocks;
+            m_free = other.m_free;
+            m_shared = other.m_shared;
+        }
+        return *this;
+    }
+
+    template<size_t W>
+    void BasicBitsetArray<W>::assign( size_t count, size_t bits, bool on )
+    {
+        assert( (W == 0 || bits <= W * 64) && "BasicBitsetArray::assign() bits exceed the capacity" );
+
+        if ( m_compact )
+        {
+            assert( count < Shared && bits < Shared - 2 && "BasicBitsetArray::assign() too many bitsets for the compact mode" );
+
+            if ( bits != m_bits )
+            {
+                // the blocks are sized for the old bitsets
+                m_blocks.clear();
+            }
+            m_count = count;
+            m_bits = bits;
+            initShared();
+
+            m_slots.assign( count, Shared + (on ? 1 : 0) );
+            m_free.clear();
+            for ( size_t slot = m_blocks.size() * BlockSize; slot-- > 0; )
+            {
+                m_free.push_back( static_cast<uint32_t>( slot ) );
+            }
+            return;
+        }
+
+        const size_t padding = Alignment / sizeof( uint64_t ) - 1;
+
+        m_count = count;
+        m_bits = bits;
+        m_storage.resize( m_count * stride() + padding );
+
+        const size_t misalignment = reinterpret_cast<uintptr_t>( m_storage.data() ) % Alignment;
+        m_data = m_storage.data() + (misalignment ? (Alignment - misalignment) / sizeof( uint64_t ) : 0);
+
+        for ( size_t i = 0; i < m_count; ++i )
+        {
+            detail::fill( m_data + i * stride(), stride(), m_bits, on );
+        }
+    }
+
+    template<size_t W>
+    void BasicBitsetArray<W>::attach( const uint64_t* data, size_t count, size_t bits )
+    {
+        assert( (W == 0 || bits <= W * 64) && "BasicBitsetArray::attach() bits exceed the capacity" );
+
+        *this = BasicBitsetArray();
+        m_data = const_cast<uint64_t*>( data );
+        m_count = count;
+        m_bits = bits;
+    }
+
+    template<size_t W>
+    void BasicBitsetArray<W>::setCompact( bool on )
+    {
+        if ( on == m_compact )
+        {
+            return;
+        }
+
+        if ( on )
+        {
+            std::vector<uint64_t> storage;
+            std::swap( storage, m_storage );
+            const uint64_t* data = m_data;
+            m_data = nullptr;
+
+            m_compact = true;
+            assign( m_count, m_bits, false );
+            for ( size_t i = 0; i < m_count; ++i )
+            {
+                std::copy( data + i * stride(), data + (i + 1) * stride(), (*this)[i].data() );
+                shrink( i );
+            }
+        }
+        else
+        {
+            BasicBitsetArray dense;
+            dense.assign( m_count, m_bits, false );
+            for ( size_t i = 0; i < m_count; ++i )
+            {
+                std::copy( data( i ), data( i ) + stride(), dense.m_data + i * stride() );
+            }
+            *this = std::move( dense );
+        }
+    }
+
+    template<size_t W>
+    void BasicBitsetArray<W>::shrink( size_t index )
+    {
+        if ( !m_compact || m_slots[index] >= Shared )
+        {
+            return;
+        }
+
+        const ConstView bitset( data( index ), m_bits );
+        const size_t count = bitset.count();
+
+        uint32_t shared;
+        if ( count == 0 )
+        {
+            shared = Shared;
+        }
+        else if ( count == m_bits )
+        {
+            shared = Shared + 1;
+        }
+        else if ( count == 1 )
+        {
+            shared = Shared + 2 + static_cast<uint32_t>( bitset.first() );
+        }
+        else
+        {
+            return;
+        }
+
+        m_free.push_back( m_slots[index] );
+        m_slots[index] = shared;
+    }
+
+    template<size_t W>
+    size_t BasicBitsetArray<W>::capacity() const
+    {
+        if ( !m_compact )
+        {
+            return m_storage.size();
+        }
+        return m_blocks.size() * BlockSize * stride() + m_shared.size();
+    }
+
+    template<size_t W>
+    typename BasicBitsetArray<W>::View BasicBitsetArray<W>::operator[]( size_t index )
+    {
+        if ( !m_compact )
+        {
+            return View( m_data + index * stride(), m_bits );
+        }
+
+        const uint32_t slot = m_slots[index];
+        if ( slot < Shared )
+        {
+            return View( slotData( slot ), m_bits );
+        }
+
+        if ( m_free.empty() )
+        {
+            m_blocks.emplace_back( BlockSize * stride() );
+            for ( size_t i = BlockSize; i-- > 0; )
+            {
+                m_free.push_back( static_cast<uint32_t>( (m_blocks.size() - 1) * BlockSize + i ) );
+            }
+        }
+
+        m_slots[index] = m_free.back();
+        m_free.pop_back();
+
+        uint64_t* stored = slotData( m_slots[index] );
+        const uint64_t* content = slotData( slot );
+        std::copy( content, content + stride(), stored );
+        return View( stored, m_bits );
+    }
+
+    template<size_t W>
+    size_t BasicBitsetArray<W>::first( size_t index ) const
+    {
+        if ( m_compact && m_slots[index] >= Shared + 2 )
+        {
+            return m_slots[index] - Shared - 2;
+        }
+        return ( *this )[index].first();
+    }
+
+    template<size_t W>
+    const uint64_t* BasicBitsetArray<W>::data( size_t index ) const
+    {
+        return m_compact ? slotData( m_slots[index] ) : m_data + index * stride();
+    }
+
+    template<size_t W>
+    uint64_t* BasicBitsetArray<W>::slotData( uint32_t slot )
+    {
+        return const_cast<uint64_t*>( static_cast<const BasicBitsetArray&>( *this ).slotData( slot ) );
+    }
+
+    template<size_t W>
+    const uint64_t* BasicBitsetArray<W>::slotData( uint32_t slot ) const
+    {
+        if ( slot >= Shared )
+        {
+            return m_shared.data() + (slot - Shared) * stride();
+        }
+        return m_blocks[slot / BlockSize].data() + (slot % BlockSize) * stride();
+    }
+
+    template<size_t W>
+    void BasicBitsetArray<W>::initShared()
+    {
+        const size_t words = stride();
+        if ( m_shared.size() == (m_bits + 2) * words )
+        {
+            return;
+        }
+
+        m_shared.assign( (m_bits + 2) * words, 0 );
+        detail::fill( m_shared.data() + words, words, m_bits, true );
+        for ( size_t i = 0; i < m_bits; ++i )
+        {
+            m_shared[(i + 2) * words + i / 64] = uint64_t( 1 ) << (i % 64);
+        }
+    }
+
+    inline
+    void EntropyIndex::reset( size_t cells, size_t count )
+    {
+        assert( cells <= UINT32_MAX && "EntropyIndex::reset() too many cells" );
+
+        m_buckets.resize( std::max<size_t>( m_buckets.size(), count + 1 ) );
+        for ( auto& bucket : m_buckets )
+        {
+            bucket.clear();
+        }
+
+        m_counts.assign( cells, static_cast<uint32_t>( count ) );
+        m_slots.resize( cells );
+        m_min = count;
+        m_tracked = 0;
+        if ( m_tracking )
+        {
+            m_moved.reset( cells );
+        }
+
+        if ( count > 1 )
+        {
+            auto& bucket = m_buckets[count];
+            bucket.resize( cells );
+            for ( size_t i = 0; i < cells; ++i )
+            {
+                bucket[i] = static_cast<uint32_t>( i );
+                m_slots[i] = static_cast<uint32_t>( i );
+            }
+            m_tracked = cells;
+        }
+    }
+
+    inline
+    void EntropyIndex::update( size_t id, size_t count )
+    {
+        const size_t current = m_counts[id];
+        if ( current == count )
+        {
+            return;
+        }
+
+        if ( current > 1 )
+        {
+            erase( id );
+        }
+
+        m_counts[id] = static_cast<uint32_t>( count );
+
+        if ( count > 1 )
+        {
+            insert( id, count );
+        }
+    }
+
+    template<class Rnd>
+    size_t EntropyIndex::pick( Rnd& rnd )
+    {
+        assert( !empty() && "EntropyIndex::pick() no cells to pick from" );
+
+        while ( m_buckets[m_min].empty() )
+        {
+            ++m_min;
+        }
+
+        const auto& bucket = m_buckets[m_min];
+        return bucket[static_cast<size_t>( detail::bounded( rnd, bucket.size() ) )];
+    }
+
+    inline
+    void EntropyIndex::insert( size_t id, size_t count )
+    {
+        if ( count >= m_buckets.size() )
+        {
+            m_buckets.resize( count + 1 );
+        }
+
+        auto& bucket = m_buckets[count];
+        m_slots[id] = static_cast<uint32_t>( bucket.size() );
+        bucket.push_back( static_cast<uint32_t>( id ) );
+        m_min = std::min( m_min, count );
+        ++m_tracked;
+    }
+
+    inline
+    void EntropyIndex::erase( size_t id )
+    {
+        auto& bucket = m_buckets[m_counts[id]];
+        const uint32_t slot = m_slots[id];
+        const uint32_t last = bucket.back();
+        bucket[slot] = last;
+        m_slots[last] = slot;
+        bucket.pop_back();
+        --m_tracked;
+
+        if ( m_tracking && last != id )
+        {
+            m_moved.add( last );
+        }
+    }
+
+    inline
+    void EntropyIndex::track( bool on )
+    {
+        m_tracking = on;
+        m_moved.reset( on ? m_counts.size() : 0 );
+    }
+
+    inline
+    void EntropyIndex::resizeBuckets( const uint32_t* sizes, size_t buckets, size_t lowest )
+    {
+        m_buckets.resize( std::max( m_buckets.size(), buckets ) );
+        m_tracked = 0;
+        for ( size_t i = 0; i < m_buckets.size(); ++i )
+        {
+            m_buckets[i].resize( i < buckets ? sizes[i] : 0 );
+            m_tracked += m_buckets[i].size();
+        }
+        m_min = lowest;
+    }
+
+    inline
+    void EntropyIndex::place( size_t id, size_t count, size_t slot )
+    {
+        m_counts[id] = static_cast<uint32_t>( count );
+        if ( count > 1 )
+        {
+            m_slots[id] = static_cast<uint32_t>( slot );
+            m_buckets[count][slot] = static_cast<uint32_t>( id );
+        }
+    }
+
+    inline
+    void CellSet::reset( size_t cells )
+    {
+        m_ids.clear();
+        m_marks.assign( cells, false );
+    }
+
+    inline
+    void CellSet::add( size_t id )
+    {
+        if ( !m_marks[id] )
+        {
+            m_marks[id] = true;
+            m_ids.push_back( static_cast<uint32_t>( id ) );
+        }
+    }
+
+    inline
+    void CellSet::clear()
+    {
+        for ( uint32_t id : m_ids )
+        {
+            m_marks[id] = false;
+        }
+        m_ids.clear();
+    }
+
+    inline
+    Xoshiro256::Xoshiro256( uint64_t value )
+    {
+        seed( value );
+    }
+
+    inline
+    void Xoshiro256::seed( uint64_t value )
+    {
+        for ( uint64_t& word : m_state )
+        {
+            word = detail::splitMix64( value );
+        }
+    }
+
+    inline
+    Xoshiro256::result_type Xoshiro256::operator()()
+    {
+        const uint64_t result = detail::rotl( m_state[1] * 5, 7 ) * 9;
+        const uint64_t t = m_state[1] << 17;
+
+        m_state[2] ^= m_state[0];
+        m_state[3] ^= m_state[1];
+        m_state[1] ^= m_state[2];
+        m_state[0] ^= m_state[3];
+        m_state[2] ^= t;
+        m_state[3] = detail::rotl( m_state[3], 45 );
+
+        return result;
+    }
+
+    inline
+    Xoshiro256 Xoshiro256::split( uint64_t stream ) const
+    {
+        // the new state is seeded from the whole current one, so the streams start at the unrelated points
+        // of the 2^256 - 1 long sequence, the chance they overlap is negligible
+        uint64_t value = m_state[0] ^ detail::rotl( m_state[1], 16 ) ^ detail::rotl( m_state[2], 32 ) ^ detail::rotl( m_state[3], 48 );
+        value ^= detail::splitMix64( stream );
+        return Xoshiro256( detail::splitMix64( value ) );
+    }
+
+    inline
+    std::ostream& operator<<( std::ostream& out, const Xoshiro256& rnd )
+    {
+        return out << rnd.m_state[0] << ' ' << rnd.m_state[1] << ' ' << rnd.m_state[2] << ' ' << rnd.m_state[3];
+    }
+
+    inline
+    std::istream& operator>>( std::istream& in, Xoshiro256& rnd )
+    {
+        uint64_t state[4];
+        if ( in >> state[0] >> state[1] >> state[2] >> state[3] )
+        {
+            // the all-zero state is the only one the generator can't leave
+            if ( state[0] | state[1] | state[2] | state[3] )
+            {
+                memcpy( rnd.m_state, state, sizeof( state ) );
+            }
+            else
+            {
+                in.setstate( std::ios::failbit );
+            }
+        }
+        return in;
+    }
+
+    inline
+    bool Grid2D::neighbor( size_t id, int dir, size_t width, size_t height, size_t, int wrap, size_t& neighbor )
+    {
+        const size_t x = id % width;
+        const size_t y = id / width;
+
+        // the neighbors across the wrapped edges are at the opposite edge
+        switch ( dir )
+        {
+        case 0: // Up
+            neighbor = y > 0 ? id - width : id + (height - 1) * width;
+            return y > 0 || (wrap & 2);
+
+        case 1: // Down
+            neighbor = y < height - 1 ? id + width : x;
+            return y < height - 1 || (wrap & 2);
+
+        case 2: // Left
+            neighbor = x > 0 ? id - 1 : id + width - 1;
+            return x > 0 || (wrap & 1);
+
+        case 3: // Right
+            neighbor = x < width - 1 ? id + 1 : id - x;
+            return x < width - 1 || (wrap & 1);
+        }
+
+        return false;
+    }
+
+    inline
+    bool Grid3D::neighbor( size_t id, int dir, size_t width, size_t height, size_t depth, int wrap, size_t& neighbor )
+    {
+        const size_t layer = width * height;
+        const size_t z = id / layer;
+
+        if ( dir == Below )
+        {
+            neighbor = z > 0 ? id - layer : id + (depth - 1) * layer;
+            return z > 0 || (wrap & 4);
+        }
+        if ( dir == Above )
+        {
+            neighbor = z < depth - 1 ? id + layer : id - z * layer;
+            return z < depth - 1 || (wrap & 4);
+        }
+
+        // same as a plain grid inside the layer
+        if ( !Grid2D::neighbor( id - z * layer, dir, width, height, 1, wrap, neighbor ) )
+        {
+            return false;
+        }
+        neighbor += z * layer;
+        return true;
+    }
+
+    inline
+    bool HexGrid::neighbor( size_t id, int dir, size_t width, size_t height, size_t, int wrap, size_t& neighbor )
+    {
+        const std::ptrdiff_t x = static_cast<std::ptrdiff_t>( id % width );
+        const std::ptrdiff_t y = static_cast<std::ptrdiff_t>( id / width );
+        const std::ptrdiff_t odd = y & 1;
+
+        std::ptrdiff_t nx = x;
+        std::ptrdiff_t ny = y;
+        switch ( dir )
+        {
+        case UpLeft:
+            nx = x + odd - 1;
+            ny = y - 1;
+            break;
+        case DownRight:
+            nx = x + odd;
+            ny = y + 1;
+            break;
+        case Left:
+            nx = x - 1;
+            break;
+        case Right:
+            nx = x + 1;
+            break;
+        case UpRight:
+            nx = x + odd;
+            ny = y - 1;
+            break;
+        case DownLeft:
+            nx = x + odd - 1;
+            ny = y + 1;
+            break;
+        }
+
+        const std::ptrdiff_t w = static_cast<std::ptrdiff_t>( width );
+        const std::ptrdiff_t h = static_cast<std::ptrdiff_t>( height );
+        if ( (nx < 0 || nx >= w) && !(wrap & 1) )
+        {
+            return false;
+        }
+        if ( (ny < 0 || ny >= h) && !(wrap & 2) )
+        {
+            return false;
+        }
+
+        neighbor = static_cast<size_t>( ((ny + h) % h) * w + (nx + w) % w );
+        return true;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    struct Wave<T, MaxTiles, Topology, Random>::Neighbors
+    {
+        Neighbors( size_t tiles )
+            : up( tiles )
+            , down( tiles )
+            , left( tiles )
+            , right( tiles )
+            , more( Directions - 4, Bitset( tiles ) )
+        {
+        }
+
+        const Bitset& operator[]( int dir ) const
+        {
+            assert( dir >= 0 && dir < Directions && "Neighbors::operator[] wrong direction" );
+            return const_cast<Neighbors*>(this)->operator[]( dir );
+        }
+
+        Bitset& operator[]( int dir )
+        {
+            assert( dir >= 0 && dir < Directions && "Neighbors::operator[] wrong direction" );
+            switch ( dir )
+            {
+            case Up:
+                return up;
+            case Down:
+                return down;
+            case Left:
+                return left;
+            case Right:
+                return right;
+            }
+            return more[dir - 4];
+        }
+
+        Bitset up;
+        Bitset down;
+        Bitset left;
+        Bitset right;
+        std::vector<Bitset> more; /// the directions after Right, if the topology has them
+    };
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    struct Wave<T, MaxTiles, Topology, Random>::Seed
+    {
+        std::vector<T> tiles;
+        std::vector<double> weights;
+        std::vector<Neighbors> neighbors;
+        size_t rndSeed = 0;
+    };
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    class Wave<T, MaxTiles, Topology, Random>::RuleSet
+    {
+    public:
+        /*
+        * Compile the rules from the prepared seed, the seed's rndSeed is not used
+        */
+        explicit RuleSet( const Seed& seed );
+
+        /*
+        * Extract the rules from a pattern, see Wave::init()
+        * @param threads the number of threads to build the adjacency with, zero means all the hardware threads
+        * @param wrap the pattern edges that wrap around, see Wrap
+        * @param symmetry the transformed tiles to add, see Symmetry
+        */
+        RuleSet(
+            const std::vector<T>& pattern,
+            size_t patternWidth, size_t patternHeight,
+            size_t tileWidth, size_t tileHeight,
+            size_t threads = 1,
+            int wrap = NoWrap,
+            int symmetry = NoSymmetry );
+
+        RuleSet( const RuleSet& ) = delete;
+        RuleSet& operator=( const RuleSet& ) = delete;
+
+        /*
+        * The number of tiles
+        */
+        size_t size() const;
+
+        const std::vector<T>& getTiles() const;
+        const std::vector<double>& getWeights() const;
+
+        /*
+        * Get the tiles allowed next to the given tile, in the given direction
+        */
+        ConstCell getNeighbors( size_t tile, int dir ) const;
+
+        /*
+        * Unpack the rules back into a seed, e.g. to save them
+        */
+        Seed toSeed() const;
+
+        /*
+        * Get the summary of the rules build
+        */
+        const InitReport& getReport() const;
+
+        /*
+        * Write the rules to a flat binary file, so they could be used in place later, see load() and map().
+        * The file is only readable on the machines with the same byte order, and by the Waves with the same T, MaxTiles and number of directions
+        * @note T is written as is, so it should be trivially copyable
+        * @return false if the file couldn't be written
+        */
+        bool save( const std::string& path ) const;
+
+        /*
+        * Same as save(), but to a memory block
+        */
+        std::vector<uint8_t> serialize() const;
+
+        /*
+        * Use the rules written by save() right where they are. Only the tiles and the weights are copied,
+        * the neighbor sets are read from the memory directly, so it takes no time regardless of the tileset size
+        * @param data the content of the file, aligned to 8 bytes at least
+        * @param size its size
+        * @param owner keeps the memory alive while the rules are used, may be empty if the memory outlives the rules anyway
+        * @return nullptr if the data is not valid or was written for another T, MaxTiles or number of directions
+        */
+        static RuleSetPtr load( const void* data, size_t size, std::shared_ptr<const void> owner = nullptr );
+
+        /*
+        * Same as load(), for a file mapped into memory. The pages are shared by all the processes that map the same file
+        * @return nullptr if the file couldn't be read or is not valid
+        */
+        static RuleSetPtr map( const std::string& path );
+
+    private:
+        friend class Wave;
+
+        RuleSet();
+
+        /*
+        * Find the unique tiles of a pattern and their relationship, see the constructor
+        */
+        void extract(
+            const std::vector<T>& pattern,
+            size_t patternWidth, size_t patternHeight,
+            size_t tileWidth, size_t tileHeight,
+            size_t threads, int symmetry );
+
+        /*
+        * Build the helper sets from m_neighborSets
+        */
+        void compile();
+
+        /*
+        * Convert the tiles relationship into plain lists, see m_adjacency.
+        * These are needed by Propagation::Supports only, so they are built on the first request (thread-safe)
+        */
+        void compileSupports() const;
+
+        /**
+        * Check two tiles if they could be placed alongside each other
+        * (with a shift of 1 cell to a given direction)
+        * @param original the first tile to be compared
+        * @param candidate the second tile to be compared
+        * @param stride the distance between the tiles' rows, in elements
+        * @param dir the shift direction to check
+        * @param w
+        * @param h tile dimensions
+        */
+        static bool isNeighbor(
+            const T* original,
+            const T* candidate,
+            size_t stride,
+            Dir dir, size_t w, size_t h );
+
+    private:
+        std::vector<T> m_tiles;
+        std::vector<double> m_weights;
+        BasicBitsetArray<Words> m_neighborSets; /// [tile * Directions + dir] the tiles allowed next to the tile, packed with the field stride
+        std::vector<TileSet> m_openNeighbors; /// [dir] the tiles allowed next to a cell that has all tiles possible
+        TileSet m_allTiles; /// this Bitset holds all tiles allowed, used to simulate the "neighbor" at the field boundaries
+        InitReport m_report;
+        std::shared_ptr<const void> m_memory; /// the memory m_neighborSets is attached to, see load()
+
+        mutable std::once_flag m_supportsOnce;
+        mutable std::vector<uint32_t> m_adjacency; /// ids of the tiles allowed in each direction of each tile, stored one after another
+        mutable std::vector<size_t> m_adjacencyOffsets; /// [tile * Directions + dir] is the start of the tile's list in m_adjacency
+        mutable std::vector<uint16_t> m_fullSupports; /// [tile * Directions + dir] is the tile's support when the neighbor has all tiles possible
+    };
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    Wave<T, MaxTiles, Topology, Random>::RuleSet::RuleSet()
+        : m_allTiles( 1 )
+    {
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    Wave<T, MaxTiles, Topology, Random>::RuleSet::RuleSet( const Seed& seed )
+        : m_tiles( seed.tiles )
+        , m_weights( seed.weights )
+        , m_allTiles( 1 )
+    {
+        assert( !seed.tiles.empty() && "RuleSet::RuleSet() empty seed tiles" );
+        assert( seed.tiles.size() == seed.weights.size() && "RuleSet::RuleSet() tiles and weights size mismatch" );
+        assert( seed.tiles.size() == seed.neighbors.size() && "RuleSet::RuleSet() tiles and neighbors size mismatch" );
+
+        const size_t tiles = m_tiles.size();
+        m_report.tiles = tiles;
+
+        m_neighborSets.assign( tiles * Directions, tiles, false );
+        for ( size_t tile = 0; tile < tiles; ++tile )
+        {
+            for ( int dir = 0; dir < Directions; ++dir )
+            {
+                const auto& allowed = seed.neighbors[tile][dir];
+                memcpy( m_neighborSets[tile * Directions + dir].data(), allowed.data(), sizeof( uint64_t ) * detail::wordCount( tiles ) );
+            }
+        }
+
+        compile();
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    Wave<T, MaxTiles, Topology, Random>::RuleSet::RuleSet(
+        const std::vector<T>& pattern,
+        size_t patternWidth, size_t patternHeight,
+        size_t tileWidth, size_t tileHeight,
+        size_t threads,
+        int wrap,
+        int symmetry )
+        : m_allTiles( 1 )
+    {
+        static_assert( std::is_same<Topology, Grid2D>::value, "RuleSet::RuleSet() the pattern extraction needs Grid2D" );
+
+        assert( patternWidth * patternHeight <= pattern.size() && "RuleSet::RuleSet() pattern size mismatch" );
+        assert( tileWidth <= patternWidth && tileHeight <= patternHeight && "RuleSet::RuleSet() wrong tile dimensions" );
+
+        if ( wrap == NoWrap )
+        {
+            extract( pattern, patternWidth, patternHeight, tileWidth, tileHeight, threads, symmetry );
+            return;
+        }
+
+        // the tiles crossing the edges are taken from the pattern extended with its own beginning
+        const auto wrapped = detail::wrapPattern( pattern, patternWidth, patternHeight,
+            (wrap & WrapX) ? tileWidth - 1 : 0, (wrap & WrapY) ? tileHeight - 1 : 0 );
+        extract( wrapped, patternWidth, patternHeight, tileWidth, tileHeight, threads, symmetry );
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::RuleSet::extract(
+        const std::vector<T>& pattern,
+        size_t patternWidth, size_t patternHeight,
+        size_t tileWidth, size_t tileHeight,
+        size_t threads, int symmetry )
+    {
+        if ( threads == 0 )
+        {
+            threads = std::max<size_t>( 1, std::thread::hardware_concurrency() );
+        }
+
+        using clock = std::chrono::steady_clock;
+        auto before = clock::now();
+
+
+        std::vector<uint64_t> hashes( patternWidth * patternHeight );
+        for ( size_t i = 0; i < hashes.size(); ++i )
+        {
+            hashes[i] = detail::hashBytes( &pattern[i], sizeof( T ) );
+        }
+
+        const size_t cols = patternWidth - tileWidth + 1;
+        const size_t rows = patternHeight - tileHeight + 1;
+        const auto tileHashes = detail::windowHashes( hashes, patternWidth, patternHeight, tileWidth, tileHeight );
+
+        auto sameTile = [&]( size_t a, size_t b )
+        {
+            for ( size_t i = 0; i < tileHeight; ++i )
+            {
+                if ( 0 != memcmp( &pattern[a + i * patternWidth], &pattern[b + i * patternWidth], sizeof( T ) * tileWidth ) )
+                {
+                    return false;
+                }
+            }
+            return true;
+        };
+
+        // tiles are identified by the position of their first occurrence in the pattern,
+        // the ones with the same hash are chained together
+        const uint32_t none = UINT32_MAX;
+        std::vector<size_t> origins;
+        std::vector<uint32_t> chain;
+        std::unordered_map<uint64_t, uint32_t> lookup;
+        lookup.reserve( tileHashes.size() );
+
+        for ( size_t x = 0; x < cols; ++x )
+        {
+            for ( size_t y = 0; y < rows; ++y )
+            {
+                const size_t startId = y * patternWidth + x;
+                auto& head = lookup.emplace( tileHashes[y * cols + x], none ).first->second;
+
+                uint32_t tile = head;
+                while ( tile != none && !sameTile( origins[tile], startId ) )
+                {
+                    tile = chain[tile];
+                }
+
+                if ( tile == none )
+                {
+                    chain.push_back( head );
+                    head = static_cast<uint32_t>( origins.size() );
+                    origins.push_back( startId );
+                    m_weights.push_back( 1 );
+                    m_tiles.push_back( pattern[startId] );
+                }
+                else
+                {
+                    m_weights[tile] += 1;
+                }
+            }
+        }
+
+        // the transformed tiles are not in the pattern, so they are kept in an atlas, tileWidth * tileHeight elements each.
+        // They are deduplicated the same way, their hashes are combined from the pattern's ones without taking them apart
+        const auto transforms = detail::symmetryTransforms( (symmetry & Rotations) != 0, (symmetry & Reflections) != 0, tileWidth == tileHeight );
+        const size_t area = tileWidth * tileHeight;
+        std::vector<T> atlas;
+        std::vector<std::pair<size_t, detail::Transform>> sources; /// [tile] the origin of the tile it's made of, and the transform
+
+        if ( transforms.size() > 1 )
+        {
+            const size_t base = origins.size();
+            const std::vector<double> baseWeights = m_weights;
+            atlas.reserve( base * area * transforms.size() );
+            for ( size_t tile = 0; tile < base; ++tile )
+            {
+                for ( size_t i = 0; i < tileHeight; ++i )
+                {
+                    atlas.insert( atlas.end(), &pattern[origins[tile] + i * patternWidth], &pattern[origins[tile] + i * patternWidth] + tileWidth );
+                }
+                sources.emplace_back( origins[tile], transforms[0] );
+            }
+
+            std::vector<T> variant( area );
+            for ( size_t source = 0; source < base; ++source )
+            {
+                for ( size_t t = 1; t < transforms.size(); ++t )
+                {
+                    for ( size_t y = 0; y < tileHeight; ++y )
+                    {
+                        for ( size_t x = 0; x < tileWidth; ++x )
+                        {
+                            variant[y * tileWidth + x] = pattern[origins[source] + detail::transformedOffset( transforms[t], patternWidth, tileWidth, tileHeight, x, y )];
+                        }
+                    }
+
+                    const uint64_t hash = detail::transformedHash( &hashes[origins[source]], patternWidth, tileWidth, tileHeight, transforms[t], 0, 0, tileWidth, tileHeight );
+                    auto& head = lookup.emplace( hash, none ).first->second;
+
+                    uint32_t tile = head;
+                    while ( tile != none && 0 != memcmp( &atlas[tile * area], variant.data(), sizeof( T ) * area ) )
+                    {
+                        tile = chain[tile];
+                    }
+
+                    if ( tile == none )
+                    {
+                        chain.push_back( head );
+                        head = static_cast<uint32_t>( sources.size() );
+                        atlas.insert( atlas.end(), variant.begin(), variant.end() );
+                        sources.emplace_back( origins[source], transforms[t] );
+                        m_weights.push_back( baseWeights[source] );
+                        m_tiles.push_back( variant[0] );
+                    }
+                    else
+                    {
+                        m_weights[tile] += baseWeights[source];
+                    }
+                }
+            }
+        }
+
+        const size_t tiles = m_tiles.size();
+        m_report.tiles = tiles;
+        m_report.samples = cols * rows;
+        m_report.extraction = clock::now() - before;
+        before = clock::now();
+
+        // two tiles could be neighbors only if their overlapping parts are the same,
+        // so the tiles are grouped by the hashes of these parts, and only the tiles inside a group are compared
+        const auto rowsHashes = detail::windowHashes( hashes, patternWidth, patternHeight, tileWidth, tileHeight - 1 );
+        const auto colsHashes = detail::windowHashes( hashes, patternWidth, patternHeight, tileWidth - 1, tileHeight );
+
+        using Key = std::pair<uint64_t, uint32_t>;
+        std::vector<Key> parts[4]; /// [dir] the hash of the part that overlaps with a neighbor in this direction, and the tile id
+        for ( int dir = 0; dir < 4; ++dir )
+        {
+            parts[dir].reserve( tiles );
+        }
+
+        for ( size_t tile = 0; tile < tiles; ++tile )
+        {
+            const uint32_t id = static_cast<uint32_t>( tile );
+
+            if ( atlas.empty() )
+            {
+                const size_t x = origins[tile] % patternWidth;
+                const size_t y = origins[tile] / patternWidth;
+
+                parts[Up].emplace_back( rowsHashes[y * cols + x], id );
+                parts[Down].emplace_back( rowsHashes[(y + 1) * cols + x], id );
+                parts[Left].emplace_back( colsHashes[y * (cols + 1) + x], id );
+                parts[Right].emplace_back( colsHashes[y * (cols + 1) + x + 1], id );
+            }
+            else
+            {
+                // same as above, as if the transformed tile was in the pattern
+                const uint64_t* source = &hashes[sources[tile].first];
+                const detail::Transform t = sources[tile].second;
+
+                parts[Up].emplace_back( detail::transformedHash( source, patternWidth, tileWidth, tileHeight, t, 0, 0, tileWidth, tileHeight - 1 ), id );
+                parts[Down].emplace_back( detail::transformedHash( source, patternWidth, tileWidth, tileHeight, t, 0, 1, tileWidth, tileHeight - 1 ), id );
+                parts[Left].emplace_back( detail::transformedHash( source, patternWidth, tileWidth, tileHeight, t, 0, 0, tileWidth - 1, tileHeight ), id );
+                parts[Right].emplace_back( detail::transformedHash( source, patternWidth, tileWidth, tileHeight, t, 1, 0, tileWidth - 1, tileHeight ), id );
+            }
+        }
+
+        // the tiles are compared right in the pattern, or in the atlas if there are the transformed ones
+        const size_t stride = atlas.empty() ? patternWidth : tileWidth;
+        auto pixels = [&]( size_t tile )
+        {
+            return atlas.empty() ? &pattern[origins[tile]] : &atlas[tile * area];
+        };
+
+        std::vector<Key> buckets[4]; /// [dir] same as parts[revDir( dir )], sorted by hash
+        for ( int dir = 0; dir < 4; ++dir )
+        {
+            buckets[dir] = parts[revDir( dir )];
+            std::sort( buckets[dir].begin(), buckets[dir].end() );
+        }
+
+        m_neighborSets.assign( tiles * Directions, tiles, false );
+
+        std::atomic<size_t> comparisons( 0 );
+        std::atomic<size_t> neighbors( 0 );
+
+        // every tile fills its own neighbor sets only, so the tiles could be processed concurrently
+        detail::parallelFor( tiles, threads, [&]( size_t begin, size_t end )
+        {
+            size_t compared = 0;
+            size_t found = 0;
+
+            for ( size_t tile = begin; tile < end; ++tile )
+            {
+                for ( int dir = 0; dir < 4; ++dir )
+                {
+                    const uint64_t part = parts[dir][tile].first;
+                    auto range = std::equal_range(
+                        buckets[dir].begin(), buckets[dir].end(), Key( part, 0 ),
+                        []( const Key& a, const Key& b ) { return a.first < b.first; } );
+
+                    for ( auto it = range.first; it != range.second; ++it )
+                    {
+                        ++compared;
+                        if ( isNeighbor( pixels( tile ), pixels( it->second ), stride, Dir( dir ), tileWidth, tileHeight ) )
+                        {
+                            m_neighborSets[tile * Directions + dir].set( it->second, true );
+                            ++found;
+                        }
+                    }
+                }
+            }
+
+            comparisons += compared;
+            neighbors += found;
+        } );
+
+        m_report.comparisons = comparisons;
+        m_report.neighbors = neighbors;
+        m_report.adjacency = clock::now() - before;
+
+        compile();
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    size_t Wave<T, MaxTiles, Topology, Random>::RuleSet::size() const
+    {
+        return m_tiles.size();
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    const std::vector<T>& Wave<T, MaxTiles, Topology, Random>::RuleSet::getTiles() const
+    {
+        return m_tiles;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    const std::vector<double>& Wave<T, MaxTiles, Topology, Random>::RuleSet::getWeights() const
+    {
+        return m_weights;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    typename Wave<T, MaxTiles, Topology, Random>::ConstCell Wave<T, MaxTiles, Topology, Random>::RuleSet::getNeighbors( size_t tile, int dir ) const
+    {
+        assert( tile < m_tiles.size() && dir >= 0 && dir < Directions && "RuleSet::getNeighbors() wrong tile or direction" );
+        return m_neighborSets[tile * Directions + dir];
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    typename Wave<T, MaxTiles, Topology, Random>::Seed Wave<T, MaxTiles, Topology, Random>::RuleSet::toSeed() const
+    {
+        const size_t tiles = m_tiles.size();
+
+        Seed seed;
+        seed.tiles = m_tiles;
+        seed.weights = m_weights;
+        seed.neighbors.resize( tiles, Neighbors( tiles ) );
+
+        for ( size_t tile = 0; tile < tiles; ++tile )
+        {
+            for ( int dir = 0; dir < Directions; ++dir )
+            {
+                seed.neighbors[tile][dir].add( m_neighborSets[tile * Directions + dir] );
+            }
+        }
+
+        return seed;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    const typename Wave<T, MaxTiles, Topology, Random>::InitReport& Wave<T, MaxTiles, Topology, Random>::RuleSet::getReport() const
+    {
+        return m_report;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    bool Wave<T, MaxTiles, Topology, Random>::RuleSet::save( const std::string& path ) const
+    {
+        const std::vector<uint8_t> data = serialize();
+
+        std::ofstream file( path, std::ios::binary );
+        file.write( reinterpret_cast<const char*>( data.data() ), data.size() );
+        return static_cast<bool>( file );
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    std::vector<uint8_t> Wave<T, MaxTiles, Topology, Random>::RuleSet::serialize() const
+    {
+        static_assert( std::is_trivially_copyable<T>::value, "RuleSet::serialize() the tiles should be trivially copyable" );
+
+        const size_t tiles = m_tiles.size();
+        const size_t stride = m_neighborSets.stride();
+        auto align = []( size_t offset ) { return (offset + detail::RulesAlignment - 1) / detail::RulesAlignment * detail::RulesAlignment; };
+
+        detail::RulesHeader header;
+        memcpy( header.magic, detail::RulesMagic, sizeof( header.magic ) );
+        header.version = detail::RulesVersion;
+        header.byteOrder = detail::RulesByteOrder;
+        header.tileSize = sizeof( T );
+        header.tiles = tiles;
+        header.neighbors = 0;
+        for ( size_t i = 0; i < tiles * Directions; ++i )
+        {
+            header.neighbors += m_neighborSets[i].count();
+        }
+        header.stride = stride;
+        header.directions = Directions;
+        header.tilesOffset = align( sizeof( header ) );
+        header.weightsOffset = align( header.tilesOffset + tiles * sizeof( T ) );
+        header.neighborsOffset = align( header.weightsOffset + tiles * sizeof( double ) );
+        header.openOffset = align( header.neighborsOffset + tiles * Directions * stride * sizeof( uint64_t ) );
+        header.size = header.openOffset + Directions * stride * sizeof( uint64_t );
+
+        std::vector<uint8_t> data( header.size, 0 );
+        memcpy( data.data(), &header, sizeof( header ) );
+        memcpy( &data[header.tilesOffset], m_tiles.data(), tiles * sizeof( T ) );
+        memcpy( &data[header.weightsOffset], m_weights.data(), tiles * sizeof( double ) );
+        for ( size_t i = 0; i < tiles * Directions; ++i )
+        {
+            memcpy( &data[header.neighborsOffset + i * stride * sizeof( uint64_t )], m_neighborSets[i].data(), stride * sizeof( uint64_t ) );
+        }
+        for ( int dir = 0; dir < Directions; ++dir )
+        {
+            memcpy( &data[header.openOffset + dir * stride * sizeof( uint64_t )], m_openNeighbors[dir].data(), stride * sizeof( uint64_t ) );
+        }
+
+        return data;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    typename Wave<T, MaxTiles, Topology, Random>::RuleSetPtr Wave<T, MaxTiles, Topology, Random>::RuleSet::load( const void* data, size_t size, std::shared_ptr<const void> owner )
+    {
+        static_assert( std::is_trivially_copyable<T>::value, "RuleSet::load() the tiles should be trivially copyable" );
+
+        detail::RulesHeader header;
+        if ( !data || size < sizeof( header ) || reinterpret_cast<uintptr_t>( data ) % alignof( uint64_t ) != 0 )
+        {
+            return nullptr;
+        }
+        memcpy( &header, data, sizeof( header ) );
+
+        const size_t tiles = static_cast<size_t>( header.tiles );
+        const size_t stride = WordCount<Words>::get( tiles );
+        const uint64_t setSize = stride * sizeof( uint64_t );
+
+        // the counts and the offsets come from the file, so they are bounded before any math is done with them
+        auto fits = [&header]( uint64_t offset, uint64_t length )
+        {
+            return offset <= header.size && length <= header.size - offset;
+        };
+
+        const bool valid = 0 == memcmp( header.magic, detail::RulesMagic, sizeof( header.magic ) )
+            && header.version == detail::RulesVersion
+            && header.byteOrder == detail::RulesByteOrder
+            && header.tileSize == sizeof( T )
+            && header.size <= size
+            && header.tiles > 0 && header.tiles <= header.size / sizeof( T ) && header.tiles <= header.size / sizeof( double )
+            && (MaxTiles == 0 || tiles <= MaxTiles)
+            && header.stride == stride
+            && header.directions == static_cast<uint64_t>( Directions )
+            && fits( header.tilesOffset, tiles * sizeof( T ) )
+            && fits( header.weightsOffset, tiles * sizeof( double ) )
+            && header.neighborsOffset % alignof( uint64_t ) == 0
+            && tiles * Directions <= header.size / setSize && fits( header.neighborsOffset, tiles * Directions * setSize )
+            && header.openOffset % alignof( uint64_t ) == 0 && fits( header.openOffset, Directions * setSize );
+        if ( !valid )
+        {
+            return nullptr;
+        }
+
+        const uint8_t* bytes = static_cast<const uint8_t*>( data );
+        std::shared_ptr<RuleSet> rules( new RuleSet() );
+
+        rules->m_tiles.resize( tiles );
+        rules->m_weights.resize( tiles );
+        memcpy( rules->m_tiles.data(), bytes + header.tilesOffset, tiles * sizeof( T ) );
+        memcpy( rules->m_weights.data(), bytes + header.weightsOffset, tiles * sizeof( double ) );
+
+        rules->m_neighborSets.attach( reinterpret_cast<const uint64_t*>( bytes + header.neighborsOffset ), tiles * Directions, tiles );
+        rules->m_memory = std::move( owner );
+
+        // the open neighbors are stored too, so the neighbor sets are not even touched here
+        const uint64_t* open = reinterpret_cast<const uint64_t*>( bytes + header.openOffset );
+        rules->m_allTiles = TileSet( tiles, true );
+        rules->m_openNeighbors.assign( Directions, TileSet( tiles ) );
+        for ( int dir = 0; dir < Directions; ++dir )
+        {
+            rules->m_openNeighbors[dir].add( ConstCell( open + dir * stride, tiles ) );
+        }
+
+        rules->m_report.tiles = tiles;
+        rules->m_report.neighbors = static_cast<size_t>( header.neighbors );
+        return rules;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    typename Wave<T, MaxTiles, Topology, Random>::RuleSetPtr Wave<T, MaxTiles, Topology, Random>::RuleSet::map( const std::string& path )
+    {
+        size_t size = 0;
+        auto memory = mapFile( path, size );
+        if ( !memory )
+        {
+            return nullptr;
+        }
+
+        const void* data = memory.get();
+        return load( data, size, std::move( memory ) );
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::RuleSet::compile()
+    {
+        const size_t tiles = m_tiles.size();
+        assert( (MaxTiles == 0 || tiles <= MaxTiles) && "RuleSet::compile() too many tiles for this Wave" );
+
+        m_allTiles = TileSet( tiles, true );
+        m_openNeighbors.assign( Directions, TileSet( tiles ) );
+        for ( size_t tile = 0; tile < tiles; ++tile )
+        {
+            for ( int dir = 0; dir < Directions; ++dir )
+            {
+                m_openNeighbors[revDir( dir )].add( m_neighborSets[tile * Directions + dir] );
+            }
+        }
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::RuleSet::compileSupports() const
+    {
+        std::call_once( m_supportsOnce, [this]()
+        {
+            const size_t tiles = m_tiles.size();
+
+            m_adjacencyOffsets.resize( tiles * Directions + 1 );
+            m_fullSupports.assign( tiles * Directions, 0 );
+
+            for ( size_t tile = 0; tile < tiles; ++tile )
+            {
+                for ( int dir = 0; dir < Directions; ++dir )
+                {
+                    m_adjacencyOffsets[tile * Directions + dir] = m_adjacency.size();
+
+                    m_neighborSets[tile * Directions + dir].forEach( [&]( size_t other )
+                    {
+                        m_adjacency.push_back( static_cast<uint32_t>( other ) );
+                        // "tile" supports "other" when "other" sees it from the opposite side
+                        ++m_fullSupports[other * Directions + revDir( dir )];
+                    } );
+                }
+            }
+            m_adjacencyOffsets[tiles * Directions] = m_adjacency.size();
+        } );
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    bool Wave<T, MaxTiles, Topology, Random>::RuleSet::isNeighbor(
+        const T* original,
+        const T* candidate,
+        size_t stride,
+        Dir dir, size_t w, size_t h )
+    {
+        // some shenanigans to get the offsets in memory blocks
+        const size_t offset1 = dir % 2;
+        const size_t offset2 = 1 - offset1;
+
+        switch ( dir )
+        {
+        case Up:
+        case Down: // line-by-line comparison, skipping one row
+            for ( size_t y = 0; y + 1 < h; ++y )
+            {
+                if ( 0 != memcmp(
+                    &original[(y + offset1) * stride],
+                    &candidate[(y + offset2) * stride],
+                    sizeof( T ) * w ) )
+                {
+                    return false;
+                }
+            }
+            break;
+
+        case Left:
+        case Right: // line-by-line comparison, skipping one column
+            for ( size_t y = 0; y < h; ++y )
+            {
+                if ( 0 != memcmp(
+                    &original[y * stride + offset1],
+                    &candidate[y * stride + offset2],
+                    sizeof( T ) * (w - 1) ) )
+                {
+                    return false;
+                }
+            }
+            break;
+        }
+
+        return true;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    Wave<T, MaxTiles, Topology, Random>::Wave( size_t width, size_t height )
+        : m_rndSeed( 0 )
+        , m_wavefrontHead( 0 )
+        , m_visitEpoch( 0 )
+        , m_fieldW( width )
+        , m_fieldH( height )
+        , m_fieldD( 1 )
+        , m_wrap( NoWrap )
+        , m_uncertaintyCurrent( width * height )
+        , m_indexDirty( false )
+        , m_stepPending( false )
+        , m_propagation( Bitsets )
+        , m_threads( 1 )
+        , m_journal( false )
+        , m_observer( nullptr )
+        , m_observerContext( nullptr )
+        , m_output( nullptr )
+        , m_outputStride( 0 )
+        , m_contradiction( Fallback )
+        , m_maxBacktracks( 256 )
+        , m_maxRestarts( 8 )
+        , m_conflict( false )
+        , m_gaveUp( false )
+        , m_backtracks( 0 )
+        , m_restarts( 0 )
+        , m_runBacktracks( 0 )
+        , m_chain( 0 )
+        , m_sequence( 0 )
+        , m_changed( false )
+        , m_trailMark( 0 )
+        , m_decisionsMark( 0 )
+    {
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    Wave<T, MaxTiles, Topology, Random>::Wave( size_t width, size_t height, RuleSetPtr rules, size_t rndSeed )
+        : Wave( width, height )
+    {
+        init( std::move( rules ), rndSeed );
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::init( const Seed& seed )
+    {
+        init( std::make_shared<const RuleSet>( seed ), seed.rndSeed );
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::init(
+        const std::vector<T>& pattern,
+        size_t patternWidth, size_t patternHeight,
+        size_t tileWidth, size_t tileHeight,
+        size_t rndSeed,
+        int patternWrap,
+        int symmetry )
+    {
+        init( std::make_shared<const RuleSet>( pattern, patternWidth, patternHeight, tileWidth, tileHeight, getThreads(), patternWrap, symmetry ), rndSeed );
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::init( RuleSetPtr rules, size_t rndSeed )
+    {
+        assert( rules && rules->size() && "Wave::init() empty rules" );
+
+        m_rules = std::move( rules );
+        m_rndSeed = rndSeed;
+
+        initRandom();
+        initField();
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::reset( size_t rndSeed )
+    {
+        assert( m_rules && "Wave::reset() wave is not initialized" );
+
+        m_rndSeed = rndSeed;
+        initRandom();
+        resetField();
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::resize( size_t width, size_t height, size_t rndSeed )
+    {
+        m_fieldW = width;
+        m_fieldH = height;
+        reset( rndSeed );
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::setDepth( size_t depth )
+    {
+        assert( depth > 0 && (depth == 1 || Topology::Dimensions == 3) && "Wave::setDepth() the topology has no layers" );
+        m_fieldD = depth;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::setThreads( size_t threads )
+    {
+        m_threads = threads;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    size_t Wave<T, MaxTiles, Topology, Random>::getThreads() const
+    {
+        if ( m_threads == 0 )
+        {
+            return std::max<size_t>( 1, std::thread::hardware_concurrency() );
+        }
+        return m_threads;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    const typename Wave<T, MaxTiles, Topology, Random>::InitReport& Wave<T, MaxTiles, Topology, Random>::getInitReport() const
+    {
+        assert( m_rules && "Wave::getInitReport() wave is not initialized" );
+        return m_rules->getReport();
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::setPropagation( Propagation mode )
+    {
+        if ( mode == m_propagation )
+        {
+            return;
+        }
+
+        m_propagation = mode;
+        if ( !m_field.empty() )
+        {
+            initAdjacency();
+            rebuildIndex();
+        }
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    typename Wave<T, MaxTiles, Topology, Random>::Propagation Wave<T, MaxTiles, Topology, Random>::getPropagation() const
+    {
+        return m_propagation;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::setJournal( bool on )
+    {
+        m_journal = on;
+        if ( !on )
+        {
+            m_changes.clear();
+        }
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    bool Wave<T, MaxTiles, Topology, Random>::getJournal() const
+    {
+        return m_journal;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::takeChanges( std::vector<Change>& changes )
+    {
+        changes.clear();
+        std::swap( changes, m_changes );
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::setObserver( Observer observer, void* context )
+    {
+        m_observer = observer;
+        m_observerContext = context;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::setWrap( int wrap )
+    {
+        if ( wrap == m_wrap )
+        {
+            return;
+        }
+
+        m_wrap = wrap;
+        if ( !m_field.empty() )
+        {
+            // the supports depend on the neighbors
+            rebuildIndex();
+        }
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    int Wave<T, MaxTiles, Topology, Random>::getWrap() const
+    {
+        return m_wrap;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::setStorage( Storage mode )
+    {
+        m_field.setCompact( mode == Compact );
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    typename Wave<T, MaxTiles, Topology, Random>::Storage Wave<T, MaxTiles, Topology, Random>::getStorage() const
+    {
+        return m_field.compact() ? Compact : Dense;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::setContradiction( Contradiction mode, size_t maxBacktracks, size_t maxRestarts )
+    {
+        m_contradiction = mode;
+        m_maxBacktracks = maxBacktracks;
+        m_maxRestarts = maxRestarts;
+        clearTrail();
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    typename Wave<T, MaxTiles, Topology, Random>::Contradiction Wave<T, MaxTiles, Topology, Random>::getContradiction() const
+    {
+        return m_contradiction;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    size_t Wave<T, MaxTiles, Topology, Random>::getBacktracks() const
+    {
+        return m_backtracks;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    size_t Wave<T, MaxTiles, Topology, Random>::getRestarts() const
+    {
+        return m_restarts;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    typename Wave<T, MaxTiles, Topology, Random>::Stats Wave<T, MaxTiles, Topology, Random>::getStats() const
+    {
+        Stats stats;
+#if defined( C011APSY_STATS )
+        stats = m_stats;
+        if ( m_rules )
+        {
+            stats.extraction = m_rules->getReport().extraction;
+            stats.adjacency = m_rules->getReport().adjacency;
+        }
+
+        stats.bytes = m_field.capacity() * sizeof( uint64_t )
+            + m_visited.capacity() * sizeof( uint32_t )
+            + m_collapsed.capacity() / 8
+            + m_wavefront.capacity() * sizeof( uint32_t )
+            + m_supports.capacity() * sizeof( uint16_t )
+            + m_removals.capacity() * sizeof( std::pair<uint32_t, uint32_t> )
+            + m_trail.capacity() * sizeof( std::pair<uint32_t, uint32_t> )
+            + m_trailWords.capacity() * sizeof( uint64_t )
+            + m_decisions.capacity() * sizeof( Decision )
+            + m_changes.capacity() * sizeof( Change )
+            // the entropy index keeps a count and a position for every cell, and every tracked cell is in a bucket
+            + m_field.size() * sizeof( uint32_t ) * 3;
+#endif
+        return stats;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::resetStats()
+    {
+        C011APSY_STAT( m_stats = Stats() );
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::mergeStats( const Stats& other )
+    {
+#if defined( C011APSY_STATS )
+        m_stats.collapses += other.collapses;
+        m_stats.pops += other.pops;
+        m_stats.filters += other.filters;
+        m_stats.bitsRemoved += other.bitsRemoved;
+        m_stats.contradictions += other.contradictions;
+        m_stats.peakWavefront = std::max( m_stats.peakWavefront, other.peakWavefront );
+        m_stats.selection += other.selection;
+        m_stats.propagation += other.propagation;
+#else
+        (void)other;
+#endif
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    typename Wave<T, MaxTiles, Topology, Random>::Seed Wave<T, MaxTiles, Topology, Random>::buildSeed() const
+    {
+        assert( m_rules && "Wave::buildSeed() wave is not initialized" );
+        Seed seed = m_rules->toSeed();
+        seed.rndSeed = m_rndSeed;
+        return seed;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    const typename Wave<T, MaxTiles, Topology, Random>::RuleSetPtr& Wave<T, MaxTiles, Topology, Random>::getRules() const
+    {
+        return m_rules;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    typename Wave<T, MaxTiles, Topology, Random>::Field& Wave<T, MaxTiles, Topology, Random>::getField()
+    {
+        // the caller is free to alter the field, the counts have to be verified before the next step
+        m_indexDirty = true;
+        return m_field;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    const typename Wave<T, MaxTiles, Topology, Random>::Field& Wave<T, MaxTiles, Topology, Random>::getField() const
+    {
+        return m_field;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    const std::vector<T>& Wave<T, MaxTiles, Topology, Random>::getTiles() const
+    {
+        return m_rules->getTiles();
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::writeResult( T* out, size_t stride ) const
+    {
+        assert( out && !m_field.empty() && "Wave::writeResult() wave is not initialized properly" );
+
+        const auto& tiles = m_rules->getTiles();
+        if ( stride == 0 )
+        {
+            stride = m_fieldW * sizeof( T );
+        }
+
+        for ( size_t y = 0; y < m_fieldH * m_fieldD; ++y )
+        {
+            T* row = reinterpret_cast<T*>( reinterpret_cast<char*>( out ) + y * stride );
+            for ( size_t x = 0; x < m_fieldW; ++x )
+            {
+                const size_t tile = m_field.first( fieldIndex( x, y ) );
+                if ( tile < tiles.size() )
+                {
+                    row[x] = tiles[tile];
+                }
+            }
+        }
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::writeTileIds( uint32_t* out, size_t stride ) const
+    {
+        assert( out && !m_field.empty() && "Wave::writeTileIds() wave is not initialized properly" );
+
+        if ( stride == 0 )
+        {
+            stride = m_fieldW * sizeof( uint32_t );
+        }
+
+        for ( size_t y = 0; y < m_fieldH * m_fieldD; ++y )
+        {
+            uint32_t* row = reinterpret_cast<uint32_t*>( reinterpret_cast<char*>( out ) + y * stride );
+            for ( size_t x = 0; x < m_fieldW; ++x )
+            {
+                row[x] = static_cast<uint32_t>( m_field.first( fieldIndex( x, y ) ) );
+            }
+        }
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::setOutput( T* out, size_t stride )
+    {
+        m_output = out;
+        m_outputStride = stride;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    size_t Wave<T, MaxTiles, Topology, Random>::getFieldWidth() const
+    {
+        return m_fieldW;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    size_t Wave<T, MaxTiles, Topology, Random>::getFieldHeight() const
+    {
+        return m_fieldH;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    size_t Wave<T, MaxTiles, Topology, Random>::getFieldDepth() const
+    {
+        return m_fieldD;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    float Wave<T, MaxTiles, Topology, Random>::getProgress() const
+    {
+        const size_t uncertaintyMax = m_field.size() * m_rules->size();
+        const size_t uncertaintyMin = m_field.size();
+        const float progress = ( uncertaintyMax - m_uncertaintyCurrent ) / static_cast<float>( uncertaintyMax - uncertaintyMin );
+        return progress * 100.f;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    bool Wave<T, MaxTiles, Topology, Random>::collapse( bool oneStep, Callback c )
+    {
+        assert( !m_field.empty() && "Wave::collapse() wave is not initialized properly" );
+
+        if ( m_indexDirty )
+        {
+            rebuildIndex();
+        }
+
+        if ( m_stepPending )
+        {
+            finishStep( c, nullptr );
+        }
+
+        while ( !m_entropy.empty() )
+        {
+            collapseStep( getCollapsePoint(), c );
+
+            if ( oneStep && !m_entropy.empty() )
+            {
+                return false;
+            }
+        }
+
+        // nothing to undo anymore
+        clearTrail();
+        return true;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    bool Wave<T, MaxTiles, Topology, Random>::collapseFor( std::chrono::nanoseconds budget, Callback c )
+    {
+        assert( !m_field.empty() && "Wave::collapseFor() wave is not initialized properly" );
+
+        const Clock::time_point deadline = Clock::now() + budget;
+
+        if ( m_indexDirty )
+        {
+            rebuildIndex();
+        }
+
+        do
+        {
+            if ( m_stepPending )
+            {
+                if ( !finishStep( c, &deadline ) )
+                {
+                    return false;
+                }
+                continue;
+            }
+
+            if ( m_entropy.empty() )
+            {
+                // nothing to undo anymore
+                clearTrail();
+                return true;
+            }
+
+            beginStep( getCollapsePoint(), c );
+        } while ( m_stepPending || Clock::now() < deadline );
+
+        return false;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    std::vector<uint8_t> Wave<T, MaxTiles, Topology, Random>::checkpoint( bool incremental )
+    {
+        assert( !m_field.empty() && "Wave::checkpoint() wave is not initialized properly" );
+
+        if ( m_indexDirty )
+        {
+            rebuildIndex();
+        }
+
+        const size_t cells = m_field.size();
+        const size_t tiles = m_rules->size();
+        const size_t stride = m_field.stride();
+        const bool supports = m_propagation == Supports;
+        const bool full = !incremental || !m_chain;
+
+        if ( full )
+        {
+            std::random_device rd;
+            m_chain = ((static_cast<uint64_t>( rd() ) << 32) | rd()) | 1;
+            m_sequence = 0;
+            m_trailMark = 0;
+            m_decisionsMark = 0;
+            m_dirty.reset( cells );
+            m_entropy.track( true );
+        }
+        else
+        {
+            ++m_sequence;
+            for ( uint32_t id : m_entropy.moved().ids() )
+            {
+                m_dirty.add( id );
+            }
+
+            if ( supports )
+            {
+                // the supports of a cell are changed by the cells around it
+                const size_t changed = m_dirty.ids().size();
+                for ( size_t i = 0; i < changed; ++i )
+                {
+                    const size_t id = m_dirty.ids()[i];
+                    for ( int dir = 0; dir < Directions; ++dir )
+                    {
+                        size_t neighbor;
+                        if ( getNeighborId( id, dir, neighbor ) )
+                        {
+                            m_dirty.add( neighbor );
+                        }
+                    }
+                }
+            }
+        }
+
+        detail::CheckpointHeader header;
+        memset( &header, 0, sizeof( header ) );
+        memcpy( header.magic, detail::CheckpointMagic, sizeof( header.magic ) );
+        header.version = detail::CheckpointVersion;
+        header.byteOrder = detail::RulesByteOrder;
+        header.chain = m_chain;
+        header.sequence = m_sequence;
+        header.width = m_fieldW;
+        header.height = m_fieldH;
+        header.depth = m_fieldD;
+        header.tiles = tiles;
+        header.stride = stride;
+        header.propagation = m_propagation;
+        header.contradiction = m_contradiction;
+        header.rndSeed = m_rndSeed;
+        header.uncertainty = m_uncertaintyCurrent;
+        header.backtracks = m_backtracks;
+        header.restarts = m_restarts;
+        header.runBacktracks = m_runBacktracks;
+        header.entropyMin = m_entropy.lowest();
+        header.stepPending = m_stepPending;
+        header.conflict = m_conflict;
+        header.gaveUp = m_gaveUp;
+        header.wrap = static_cast<uint8_t>( m_wrap );
+
+        const size_t records = full ? cells : m_dirty.ids().size();
+        const size_t recordSize = 4 * sizeof( uint32_t ) + stride * sizeof( uint64_t ) + (supports ? tiles * Directions * sizeof( uint16_t ) : 0);
+
+        std::vector<uint8_t> data;
+        data.reserve( sizeof( header ) + records * recordSize + 8192 );
+        detail::append( data, &header, 1 );
+
+        auto put = [&]( uint64_t value )
+        {
+            detail::append( data, &value, 1 );
+        };
+
+        std::ostringstream rnd;
+        rnd << m_random;
+        const std::string rndState = rnd.str();
+        put( rndState.size() );
+        detail::append( data, rndState.data(), rndState.size() );
+
+        // the cells visited by the pending step are the ones already taken from the wavefront
+        const bool wavefront = m_stepPending && !supports;
+        put( wavefront ? m_wavefrontHead : 0 );
+        put( wavefront ? m_wavefront.size() : 0 );
+        if ( wavefront )
+        {
+            detail::append( data, m_wavefront.data(), m_wavefront.size() );
+        }
+
+        put( m_removals.size() );
+        for ( const auto& removal : m_removals )
+        {
+            const uint32_t values[2] = { removal.first, removal.second };
+            detail::append( data, values, 2 );
+        }
+
+        put( m_decisionsMark );
+        put( m_decisions.size() - m_decisionsMark );
+        for ( size_t i = m_decisionsMark; i < m_decisions.size(); ++i )
+        {
+            const uint32_t values[2] = { m_decisions[i].cell, m_decisions[i].tile };
+            detail::append( data, values, 2 );
+            put( m_decisions[i].trail );
+        }
+
+        put( m_trailMark );
+        put( m_trail.size() - m_trailMark );
+        for ( size_t i = m_trailMark; i < m_trail.size(); ++i )
+        {
+            const uint32_t values[2] = { m_trail[i].first, m_trail[i].second };
+            detail::append( data, values, 2 );
+        }
+        if ( !supports )
+        {
+            detail::append( data, m_trailWords.data() + m_trailMark * stride, (m_trail.size() - m_trailMark) * stride );
+        }
+
+        put( m_entropy.buckets() );
+        for ( size_t i = 0; i < m_entropy.buckets(); ++i )
+        {
+            const uint32_t size = static_cast<uint32_t>( m_entropy.bucketSize( i ) );
+            detail::append( data, &size, 1 );
+        }
+
+        put( records );
+        auto writeCell = [&]( size_t id )
+        {
+            const size_t count = m_entropy.count( id );
+            const uint32_t values[4] =
+            {
+                static_cast<uint32_t>( id ),
+                static_cast<uint32_t>( count ),
+                static_cast<uint32_t>( count > 1 ? m_entropy.slot( id ) : 0 ),
+                m_collapsed[id] ? 1u : 0u,
+            };
+            detail::append( data, values, 4 );
+            detail::append( data, readCell( id ).data(), stride );
+            if ( supports )
+            {
+                detail::append( data, &support( id, 0, 0 ), tiles * Directions );
+            }
+        };
+
+        if ( full )
+        {
+            for ( size_t id = 0; id < cells; ++id )
+            {
+                writeCell( id );
+            }
+        }
+        else
+        {
+            for ( uint32_t id : m_dirty.ids() )
+            {
+                writeCell( id );
+            }
+        }
+
+        markCheckpoint();
+        return data;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    bool Wave<T, MaxTiles, Topology, Random>::restore( const void* data, size_t size )
+    {
+        assert( !m_field.empty() && "Wave::restore() wave is not initialized properly" );
+
+        detail::CheckpointHeader header;
+        detail::ByteReader in( data, size );
+        if ( !data || !in.read( header ) )
+        {
+            return false;
+        }
+
+        const size_t cells = m_field.size();
+        const size_t tiles = m_rules->size();
+        const size_t stride = m_field.stride();
+        const bool supports = m_propagation == Supports;
+        const bool full = header.sequence == 0;
+
+        const bool fits = 0 == memcmp( header.magic, detail::CheckpointMagic, sizeof( header.magic ) )
+            && header.version == detail::CheckpointVersion
+            && header.byteOrder == detail::RulesByteOrder
+            && header.chain != 0
+            && header.width == m_fieldW && header.height == m_fieldH && header.depth == m_fieldD
+            && header.tiles == tiles && header.stride == stride
+            && header.propagation == static_cast<uint32_t>( m_propagation )
+            && header.contradiction == static_cast<uint32_t>( m_contradiction )
+            && header.wrap == m_wrap
+            && (full || (header.chain == m_chain && header.sequence == m_sequence + 1 && !m_changed && !m_indexDirty));
+        if ( !fits )
+        {
+            return false;
+        }
+
+        // everything is checked before anything is changed
+        auto section = [&]( uint64_t& count, size_t elementSize ) -> const uint8_t*
+        {
+            if ( !in.read( count ) || count > size / elementSize )
+            {
+                return nullptr;
+            }
+            return in.skip( static_cast<size_t>( count ) * elementSize );
+        };
+
+        uint64_t rndSize, head, waveSize, removalCount, decisionsKeep, decisionCount, trailKeep, trailCount, bucketCount, records;
+        const uint8_t* rndState = section( rndSize, 1 );
+        const uint8_t* wavefront = in.read( head ) ? section( waveSize, sizeof( uint32_t ) ) : nullptr;
+        const uint8_t* removals = wavefront ? section( removalCount, 2 * sizeof( uint32_t ) ) : nullptr;
+        const uint8_t* decisions = removals && in.read( decisionsKeep ) ? section( decisionCount, 2 * sizeof( uint64_t ) ) : nullptr;
+        const uint8_t* trail = decisions && in.read( trailKeep ) ? section( trailCount, 2 * sizeof( uint32_t ) ) : nullptr;
+        const uint8_t* trailWords = trail ? in.skip( supports ? 0 : static_cast<size_t>( trailCount ) * stride * sizeof( uint64_t ) ) : nullptr;
+        const uint8_t* buckets = trailWords ? section( bucketCount, sizeof( uint32_t ) ) : nullptr;
+        const size_t recordSize = 4 * sizeof( uint32_t ) + stride * sizeof( uint64_t ) + (supports ? tiles * Directions * sizeof( uint16_t ) : 0);
+        const uint8_t* cellData = buckets ? section( records, recordSize ) : nullptr;
+        if ( !rndState || !cellData )
+        {
+            return false;
+        }
+
+        Random random;
+        std::istringstream rnd( std::string( reinterpret_cast<const char*>( rndState ), static_cast<size_t>( rndSize ) ) );
+        rnd >> random;
+
+        bool valid = !rnd.fail()
+            && head <= waveSize
+            && decisionsKeep <= (full ? 0 : m_decisions.size())
+            && trailKeep <= (full ? 0 : m_trail.size())
+            && header.entropyMin < std::max<uint64_t>( bucketCount, 1 )
+            && (full ? records == cells : records <= cells);
+
+        auto at = []( const uint8_t* src, size_t i )
+        {
+            uint32_t value;
+            memcpy( &value, src + i * sizeof( uint32_t ), sizeof( value ) );
+            return value;
+        };
+
+        for ( size_t i = 0; valid && i < waveSize; ++i )
+        {
+            valid = at( wavefront, i ) < cells;
+        }
+        for ( size_t i = 0; valid && i < removalCount; ++i )
+        {
+            valid = at( removals, i * 2 ) < cells && at( removals, i * 2 + 1 ) < tiles;
+        }
+        for ( size_t i = 0; valid && i < decisionCount; ++i )
+        {
+            uint64_t trailSize;
+            memcpy( &trailSize, decisions + (i * 2 + 1) * sizeof( uint64_t ), sizeof( trailSize ) );
+            valid = at( decisions, i * 4 ) < cells && at( decisions, i * 4 + 1 ) < tiles && trailSize <= trailKeep + trailCount;
+        }
+        for ( size_t i = 0; valid && i < trailCount; ++i )
+        {
+            valid = at( trail, i * 2 ) < cells && at( trail, i * 2 + 1 ) < tiles;
+        }
+
+        std::vector<uint32_t> bucketSizes( static_cast<size_t>( bucketCount ) );
+        uint64_t tracked = 0;
+        for ( size_t i = 0; valid && i < bucketSizes.size(); ++i )
+        {
+            bucketSizes[i] = at( buckets, i );
+            tracked += bucketSizes[i];
+            // the cells with less than two tiles are not tracked, nothing sits below the lowest bucket
+            valid = (bucketSizes[i] == 0 || (i > 1 && i <= tiles && i >= header.entropyMin)) && tracked <= cells;
+        }
+
+        for ( size_t i = 0; valid && i < records; ++i )
+        {
+            const uint8_t* record = cellData + i * recordSize;
+            const size_t count = at( record, 1 );
+            valid = at( record, 0 ) < cells && count <= tiles && at( record, 3 ) <= 1
+                && (count <= 1 || (count < bucketSizes.size() && at( record, 2 ) < bucketSizes[count]));
+        }
+
+        if ( !valid )
+        {
+            return false;
+        }
+
+        m_random = random;
+        m_rndSeed = static_cast<size_t>( header.rndSeed );
+        m_uncertaintyCurrent = static_cast<size_t>( header.uncertainty );
+        m_backtracks = static_cast<size_t>( header.backtracks );
+        m_restarts = static_cast<size_t>( header.restarts );
+        m_runBacktracks = static_cast<size_t>( header.runBacktracks );
+        m_stepPending = header.stepPending != 0;
+        m_conflict = header.conflict != 0;
+        m_gaveUp = header.gaveUp != 0;
+        m_indexDirty = false;
+
+        m_decisions.resize( static_cast<size_t>( decisionsKeep ) );
+        for ( size_t i = 0; i < decisionCount; ++i )
+        {
+            uint64_t trailSize;
+            memcpy( &trailSize, decisions + (i * 2 + 1) * sizeof( uint64_t ), sizeof( trailSize ) );
+            m_decisions.push_back( { at( decisions, i * 4 ), at( decisions, i * 4 + 1 ), static_cast<size_t>( trailSize ) } );
+        }
+
+        m_trail.resize( static_cast<size_t>( trailKeep ) );
+        for ( size_t i = 0; i < trailCount; ++i )
+        {
+            m_trail.emplace_back( at( trail, i * 2 ), at( trail, i * 2 + 1 ) );
+        }
+        if ( !supports && trailCount )
+        {
+            m_trailWords.resize( m_trail.size() * stride );
+            memcpy( m_trailWords.data() + trailKeep * stride, trailWords, static_cast<size_t>( trailCount ) * stride * sizeof( uint64_t ) );
+        }
+
+        m_entropy.resizeBuckets( bucketSizes.data(), bucketSizes.size(), static_cast<size_t>( header.entropyMin ) );
+
+        std::vector<uint64_t> words( stride );
+        for ( size_t i = 0; i < records; ++i )
+        {
+            const uint8_t* record = cellData + i * recordSize;
+            const size_t id = at( record, 0 );
+            const size_t count = at( record, 1 );
+
+            memcpy( words.data(), record + 4 * sizeof( uint32_t ), stride * sizeof( uint64_t ) );
+            storeCell( id, ConstCell( words.data(), tiles ) );
+            m_collapsed[id] = at( record, 3 ) != 0;
+            m_entropy.place( id, count, at( record, 2 ) );
+
+            if ( supports )
+            {
+                memcpy( &support( id, 0, 0 ), record + 4 * sizeof( uint32_t ) + stride * sizeof( uint64_t ), tiles * Directions * sizeof( uint16_t ) );
+            }
+        }
+
+        m_removals.clear();
+        for ( size_t i = 0; i < removalCount; ++i )
+        {
+            m_removals.emplace_back( at( removals, i * 2 ), at( removals, i * 2 + 1 ) );
+        }
+
+        if ( m_stepPending && !supports )
+        {
+            beginVisit();
+            m_wavefront.resize( static_cast<size_t>( waveSize ) );
+            memcpy( m_wavefront.data(), wavefront, m_wavefront.size() * sizeof( uint32_t ) );
+            m_wavefrontHead = static_cast<size_t>( head );
+            for ( size_t i = 0; i < m_wavefrontHead; ++i )
+            {
+                m_visited[m_wavefront[i]] = m_visitEpoch;
+            }
+        }
+        else
+        {
+            m_wavefront.clear();
+            m_wavefrontHead = 0;
+        }
+
+        m_chain = header.chain;
+        m_sequence = header.sequence;
+        if ( full )
+        {
+            m_dirty.reset( cells );
+            m_entropy.track( true );
+        }
+        markCheckpoint();
+        return true;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::collapseParallel( size_t chunkSize )
+    {
+        static_assert( std::is_same<Topology, Grid2D>::value, "Wave::collapseParallel() needs Grid2D" );
+
+        assert( !m_field.empty() && "Wave::collapseParallel() wave is not initialized properly" );
+        assert( chunkSize > 1 && "Wave::collapseParallel() chunks are too small" );
+
+        const size_t chunksX = (m_fieldW + chunkSize - 1) / chunkSize;
+        const size_t chunksY = (m_fieldH + chunkSize - 1) / chunkSize;
+        if ( chunksX * chunksY == 1 )
+        {
+            collapse( false );
+            return;
+        }
+
+        if ( m_indexDirty )
+        {
+            rebuildIndex();
+        }
+
+        // seams go first, in the scanline order, so every next cell is right next to the solved ones.
+        // Contradiction::Backtrack may undo the cells that are already passed, so repeat until they're all solved
+        bool pending = true;
+        while ( pending )
+        {
+            pending = false;
+            for ( size_t y = 0; y < m_fieldH; ++y )
+            {
+                for ( size_t x = 0; x < m_fieldW; ++x )
+                {
+                    const size_t id = fieldIndex( x, y );
+                    if ( isSeam( x, y, chunkSize ) && !m_collapsed[id] )
+                    {
+                        collapseStep( id, nullptr );
+                        pending = true;
+                    }
+                }
+            }
+        }
+
+        // each chunk gets its own random stream, no matter which thread solves it
+        const size_t chunks = chunksX * chunksY;
+
+        std::atomic<size_t> next( 0 );
+        std::atomic<size_t> backtracks( 0 );
+        std::atomic<size_t> restarts( 0 );
+        const size_t threads = getThreads();
+        C011APSY_STAT( std::mutex statsMutex; )
+
+        // the compact field allocates on write, so the chunks take turns accessing it
+        std::mutex fieldMutex;
+        auto lockField = [&]()
+        {
+            return m_field.compact() ? std::unique_lock<std::mutex>( fieldMutex ) : std::unique_lock<std::mutex>();
+        };
+
+        detail::parallelFor( threads, threads, [&]( size_t, size_t )
+        {
+            Wave chunk( 1, 1 );
+            Borders borders;
+
+            // a chunk as wide as the field wraps around on its own
+            chunk.m_wrap = (chunksX == 1 ? m_wrap & WrapX : 0) | (chunksY == 1 ? m_wrap & WrapY : 0);
+
+            for ( size_t i = next++; i < chunks; i = next++ )
+            {
+                // the chunk interior, plus the seams around it (already solved)
+                const size_t x0 = (i % chunksX) * chunkSize;
+                const size_t y0 = (i / chunksX) * chunkSize;
+                const size_t x1 = std::min( x0 + chunkSize - 1, m_fieldW - 1 ) + 1;
+                const size_t y1 = std::min( y0 + chunkSize - 1, m_fieldH - 1 ) + 1;
+                const size_t left = x0 > 0 ? 1 : 0;
+                const size_t top = y0 > 0 ? 1 : 0;
+
+                {
+                    auto lock = lockField();
+                    chunk.loadRegion( *this, x0 - left, y0 - top, x1 - x0 + left, y1 - y0 + top, detail::splitRandom( m_random, i ) );
+
+                    // the first chunks see the last seams across the wrapped edges
+                    borders.left.clear();
+                    borders.up.clear();
+                    if ( x0 == 0 && chunksX > 1 && (m_wrap & WrapX) )
+                    {
+                        for ( size_t y = y0 - top; y < y1; ++y )
+                        {
+                            borders.left.push_back( static_cast<uint32_t>( m_field.first( fieldIndex( m_fieldW - 1, y ) ) ) );
+                        }
+                    }
+                    if ( y0 == 0 && chunksY > 1 && (m_wrap & WrapY) )
+                    {
+                        for ( size_t x = x0 - left; x < x1; ++x )
+                        {
+                            borders.up.push_back( static_cast<uint32_t>( m_field.first( fieldIndex( x, m_fieldH - 1 ) ) ) );
+                        }
+                    }
+                }
+
+                if ( borders.left.empty() && borders.up.empty() )
+                {
+                    chunk.collapse( false );
+                }
+                else
+                {
+                    chunk.collapseChunk( borders );
+                }
+                backtracks += chunk.m_backtracks;
+                restarts += chunk.m_restarts;
+                C011APSY_STAT(
+                {
+                    std::lock_guard<std::mutex> lock( statsMutex );
+                    mergeStats( chunk.m_stats );
+                } )
+
+                // the seams are left intact: the chunks write into the disjoint sets of cells
+                const size_t innerW = isSeam( x1 - 1, y0, chunkSize ) ? x1 - x0 - 1 : x1 - x0;
+                const size_t innerH = isSeam( x0, y1 - 1, chunkSize ) ? y1 - y0 - 1 : y1 - y0;
+                auto lock = lockField();
+                for ( size_t y = 0; y < innerH; ++y )
+                {
+                    for ( size_t x = 0; x < innerW; ++x )
+                    {
+                        storeCell( fieldIndex( x0 + x, y0 + y ), chunk.readCell( chunk.fieldIndex( x + left, y + top ) ) );
+                    }
+                }
+            }
+        } );
+
+        m_backtracks += backtracks;
+        m_restarts += restarts;
+        rebuildIndex();
+
+        // the next call splits the different streams
+        m_random();
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::generateBatch(
+        const RuleSetPtr& rules,
+        size_t width, size_t height,
+        const std::vector<size_t>& seeds,
+        const std::vector<T*>& outputs,
+        size_t threads,
+        Propagation propagation )
+    {
+        assert( rules && rules->size() && "Wave::generateBatch() empty rules" );
+        assert( seeds.size() == outputs.size() && "Wave::generateBatch() seeds and outputs size mismatch" );
+
+        if ( threads == 0 )
+        {
+            threads = std::max<size_t>( 1, std::thread::hardware_concurrency() );
+        }
+
+        std::atomic<size_t> next( 0 );
+
+        // the jobs are handed out one by one, so a slow one doesn't hold the others
+        detail::parallelFor( std::min( threads, seeds.size() ), threads, [&]( size_t, size_t )
+        {
+            Wave wave( width, height );
+            wave.setPropagation( propagation );
+
+            for ( size_t i = next++; i < seeds.size(); i = next++ )
+            {
+                if ( wave.m_rules )
+                {
+                    wave.reset( seeds[i] );
+                }
+                else
+                {
+                    wave.init( rules, seeds[i] );
+                }
+                wave.collapse( false );
+                wave.writeResult( outputs[i] );
+            }
+        } );
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    typename Wave<T, MaxTiles, Topology, Random>::Estimate Wave<T, MaxTiles, Topology, Random>::estimate(
+        const std::vector<T>& pattern,
+        size_t patternWidth, size_t patternHeight,
+        size_t tileWidth, size_t tileHeight,
+        size_t width, size_t height,
+        int patternWrap,
+        int symmetry )
+    {
+        static_assert( std::is_same<Topology, Grid2D>::value, "Wave::estimate() the pattern extraction needs Grid2D" );
+
+        assert( patternWidth * patternHeight <= pattern.size() && "Wave::estimate() pattern size mismatch" );
+        assert( tileWidth <= patternWidth && tileHeight <= patternHeight && "Wave::estimate() wrong tile dimensions" );
+
+        if ( patternWrap != NoWrap )
+        {
+            // same as RuleSet
+            const auto wrapped = detail::wrapPattern( pattern, patternWidth, patternHeight,
+                (patternWrap & WrapX) ? tileWidth - 1 : 0, (patternWrap & WrapY) ? tileHeight - 1 : 0 );
+            return estimate( wrapped, patternWidth, patternHeight, tileWidth, tileHeight, width, height, NoWrap, symmetry );
+        }
+
+        std::vector<uint64_t> hashes( patternWidth * patternHeight );
+        for ( size_t i = 0; i < hashes.size(); ++i )
+        {
+            hashes[i] = detail::hashBytes( &pattern[i], sizeof( T ) );
+        }
+
+        // same as RuleSet, but the tiles with the same hash are not compared
+        const size_t cols = patternWidth - tileWidth + 1;
+        const size_t rows = patternHeight - tileHeight + 1;
+        const auto tileHashes = detail::windowHashes( hashes, patternWidth, patternHeight, tileWidth, tileHeight );
+        const auto rowsHashes = detail::windowHashes( hashes, patternWidth, patternHeight, tileWidth, tileHeight - 1 );
+        const auto colsHashes = detail::windowHashes( hashes, patternWidth, patternHeight, tileWidth - 1, tileHeight );
+
+        // the tiles whose parts have the same hash are neighbors, [hash] is the number of (up, down) or (left, right) parts
+        using Counts = std::unordered_map<uint64_t, std::pair<size_t, size_t>>;
+        Counts vertical;
+        Counts horizontal;
+        std::unordered_map<uint64_t, bool> unique;
+        unique.reserve( tileHashes.size() );
+
+        const auto transforms = detail::symmetryTransforms( (symmetry & Rotations) != 0, (symmetry & Reflections) != 0, tileWidth == tileHeight );
+        std::vector<size_t> origins;
+
+        for ( size_t y = 0; y < rows; ++y )
+        {
+            for ( size_t x = 0; x < cols; ++x )
+            {
+                if ( !unique.emplace( tileHashes[y * cols + x], true ).second )
+                {
+                    continue;
+                }
+
+                vertical[rowsHashes[y * cols + x]].first += 1;
+                vertical[rowsHashes[(y + 1) * cols + x]].second += 1;
+                horizontal[colsHashes[y * (cols + 1) + x]].first += 1;
+                horizontal[colsHashes[y * (cols + 1) + x + 1]].second += 1;
+
+                if ( transforms.size() > 1 )
+                {
+                    origins.push_back( y * patternWidth + x );
+                }
+            }
+        }
+
+        // the transformed tiles, see RuleSet::extract()
+        for ( size_t origin : origins )
+        {
+            for ( size_t i = 1; i < transforms.size(); ++i )
+            {
+                const uint64_t* source = &hashes[origin];
+                const detail::Transform t = transforms[i];
+                if ( !unique.emplace( detail::transformedHash( source, patternWidth, tileWidth, tileHeight, t, 0, 0, tileWidth, tileHeight ), true ).second )
+                {
+                    continue;
+                }
+
+                vertical[detail::transformedHash( source, patternWidth, tileWidth, tileHeight, t, 0, 0, tileWidth, tileHeight - 1 )].first += 1;
+                vertical[detail::transformedHash( source, patternWidth, tileWidth, tileHeight, t, 0, 1, tileWidth, tileHeight - 1 )].second += 1;
+                horizontal[detail::transformedHash( source, patternWidth, tileWidth, tileHeight, t, 0, 0, tileWidth - 1, tileHeight )].first += 1;
+                horizontal[detail::transformedHash( source, patternWidth, tileWidth, tileHeight, t, 1, 0, tileWidth - 1, tileHeight )].second += 1;
+            }
+        }
+
+        Estimate result;
+        result.tiles = unique.size();
+        for ( const Counts* counts : { &vertical, &horizontal } )
+        {
+            for ( const auto& part : *counts )
+            {
+                // every pair is counted for both directions
+                result.neighbors += 2 * part.second.first * part.second.second;
+            }
+        }
+
+        completeEstimate( result, width, height );
+        return result;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    typename Wave<T, MaxTiles, Topology, Random>::Estimate Wave<T, MaxTiles, Topology, Random>::estimate( const Seed& seed, size_t width, size_t height )
+    {
+        assert( seed.tiles.size() == seed.neighbors.size() && "Wave::estimate() tiles and neighbors size mismatch" );
+
+        Estimate result;
+        result.tiles = seed.tiles.size();
+        for ( const auto& neighbors : seed.neighbors )
+        {
+            for ( int dir = 0; dir < Directions; ++dir )
+            {
+                result.neighbors += neighbors[dir].count();
+            }
+        }
+
+        completeEstimate( result, width, height );
+        return result;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::completeEstimate( Estimate& estimate, size_t width, size_t height )
+    {
+        const size_t tiles = estimate.tiles;
+        const size_t cells = width * height;
+        const size_t stride = WordCount<Words>::get( tiles );
+        const size_t bitset = stride * sizeof( uint64_t );
+
+        if ( tiles == 0 )
+        {
+            return;
+        }
+
+        estimate.density = estimate.neighbors / ( static_cast<double>( Directions ) * tiles * tiles );
+
+        // the tiles, the weights, a neighbor set per tile and direction, the open neighbors and the full set
+        estimate.rulesBytes = tiles * ( sizeof( T ) + sizeof( double ) + Directions * bitset ) + (Directions + 1) * bitset;
+
+        // the cell itself, the visit mark, the entropy index (count, slot, bucket entry) and the collapsed flag
+        estimate.fieldBytes = cells * ( bitset + 4 * sizeof( uint32_t ) ) + cells / 8;
+
+        // the counters of every tile of every cell, plus the packed adjacency of the rules
+        estimate.supportsBytes = cells * tiles * Directions * sizeof( uint16_t )
+            + estimate.neighbors * sizeof( uint32_t )
+            + ( tiles * Directions + 1 ) * sizeof( size_t )
+            + tiles * Directions * sizeof( uint16_t );
+
+        // a cell is filtered in every direction: the union of the neighbor's tile sets, then the intersection.
+        // Every tile of every cell is removed at most once, and it updates the supports of its neighbors
+        const double branching = estimate.neighbors / ( static_cast<double>( Directions ) * tiles );
+        estimate.bitsetsCost = static_cast<double>( cells ) * Directions * stride * ( 1 + branching );
+        estimate.supportsCost = static_cast<double>( cells ) * estimate.neighbors;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    bool Wave<T, MaxTiles, Topology, Random>::constrain( const std::vector<size_t>& cells, const std::vector<Bitset>& allowed )
+    {
+        assert( !m_field.empty() && "Wave::constrain() wave is not initialized properly" );
+        assert( cells.size() == allowed.size() && "Wave::constrain() cells and tiles size mismatch" );
+
+        if ( m_indexDirty )
+        {
+            rebuildIndex();
+        }
+
+        if ( m_stepPending )
+        {
+            finishStep( nullptr, nullptr );
+        }
+
+        const size_t tiles = m_rules->size();
+        auto& mask = m_possibleNeighbors[0];
+        auto& kept = m_possibleNeighbors[1];
+        auto& old = m_possibleNeighbors[2];
+
+        // same as rebuildIndex(), the restricted field is the starting point, nothing to undo there
+        const bool gaveUp = m_gaveUp;
+        m_gaveUp = true;
+        m_changed = true;
+
+        bool applied = true;
+        beginVisit();
+        for ( size_t i = 0; i < cells.size(); ++i )
+        {
+            const size_t id = cells[i];
+            assert( id < m_field.size() && "Wave::constrain() wrong cell id" );
+            assert( allowed[i].size() == tiles && "Wave::constrain() wrong number of tiles" );
+
+            memcpy( mask.data(), allowed[i].data(), sizeof( uint64_t ) * detail::wordCount( tiles ) );
+            old.reset( false );
+            old.add( readCell( id ) );
+            kept.reset( false );
+            kept.add( old );
+
+            const size_t count = kept.intersectCount( mask );
+            if ( count == 0 )
+            {
+                applied = false;
+                continue;
+            }
+            if ( count == m_entropy.count( id ) )
+            {
+                continue;
+            }
+
+            if ( m_propagation == Supports )
+            {
+                old.forEach( [&]( size_t tile )
+                {
+                    if ( !kept[tile] )
+                    {
+                        removeTile( id, tile );
+                    }
+                } );
+                continue;
+            }
+
+            storeCell( id, kept );
+            updateCount( id, count );
+            m_collapsed[id] = count == 1;
+            m_wavefront.push_back( static_cast<uint32_t>( id ) );
+        }
+
+        if ( m_propagation == Supports )
+        {
+            propagateSupports( nullptr );
+        }
+        else
+        {
+            propagateConstraints();
+        }
+
+        m_gaveUp = gaveUp;
+        clearTrail();
+        return applied;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    bool Wave<T, MaxTiles, Topology, Random>::fixTile( size_t x, size_t y, size_t tile )
+    {
+        assert( m_rules && tile < m_rules->size() && "Wave::fixTile() wrong tile id" );
+        assert( x < m_fieldW && y < m_fieldH * m_fieldD && "Wave::fixTile() the cell is out of the field" );
+
+        Bitset allowed( m_rules->size() );
+        allowed.set( tile, true );
+        return constrain( { fieldIndex( x, y ) }, { allowed } );
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::collapseChunk( const Borders& borders )
+    {
+        static_assert( std::is_same<Topology, Grid2D>::value, "Wave::collapseChunk() needs Grid2D" );
+
+        assert( !m_field.empty() && "Wave::collapseChunk() wave is not initialized properly" );
+        assert( (borders.up.empty() || borders.up.size() == m_fieldW) && "Wave::collapseChunk() wrong up border size" );
+        assert( (borders.down.empty() || borders.down.size() == m_fieldW) && "Wave::collapseChunk() wrong down border size" );
+        assert( (borders.left.empty() || borders.left.size() == m_fieldH) && "Wave::collapseChunk() wrong left border size" );
+        assert( (borders.right.empty() || borders.right.size() == m_fieldH) && "Wave::collapseChunk() wrong right border size" );
+
+        const RuleSet& rules = *m_rules;
+        auto& backup = m_possibleNeighbors[0];
+
+        // dir points from the cell to the fixed tile outside
+        auto restrict = [&]( size_t x, size_t y, uint32_t tile, int dir )
+        {
+            assert( tile < rules.size() && "Wave::collapseChunk() wrong tile id" );
+
+            const Cell cell = m_field[fieldIndex( x, y )];
+            backup.reset( false );
+            backup.add( cell );
+
+            // the tile outside sees the cell from the opposite side
+            if ( cell.intersectCount( rules.m_neighborSets[tile * Directions + revDir( dir )] ) == 0 )
+            {
+                // the borders contradict each other (or the previous ones), leave the cell as it was
+                cell.add( backup );
+            }
+        };
+
+        for ( size_t x = 0; x < m_fieldW; ++x )
+        {
+            if ( !borders.up.empty() )
+            {
+                restrict( x, 0, borders.up[x], Up );
+            }
+            if ( !borders.down.empty() )
+            {
+                restrict( x, m_fieldH - 1, borders.down[x], Down );
+            }
+        }
+        for ( size_t y = 0; y < m_fieldH; ++y )
+        {
+            if ( !borders.left.empty() )
+            {
+                restrict( 0, y, borders.left[y], Left );
+            }
+            if ( !borders.right.empty() )
+            {
+                restrict( m_fieldW - 1, y, borders.right[y], Right );
+            }
+        }
+
+        collapseRestricted();
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::regenerateRegion( size_t x, size_t y, size_t width, size_t height, size_t rndSeed )
+    {
+        static_assert( std::is_same<Topology, Grid2D>::value, "Wave::regenerateRegion() needs Grid2D" );
+
+        assert( !m_field.empty() && "Wave::regenerateRegion() wave is not initialized properly" );
+        assert( width && height && x + width <= m_fieldW && y + height <= m_fieldH && "Wave::regenerateRegion() the region is out of the field" );
+
+        if ( m_indexDirty )
+        {
+            rebuildIndex();
+        }
+
+        if ( !m_region )
+        {
+            m_region = std::make_unique<Wave>( width, height );
+        }
+        Wave& region = *m_region;
+        region.copySettings( *this );
+        // the region spanning the whole wrapped field touches itself
+        region.m_wrap = (width == m_fieldW ? m_wrap & WrapX : 0) | (height == m_fieldH ? m_wrap & WrapY : 0);
+        region.resize( width, height, rndSeed );
+
+        const RuleSet& rules = *m_rules;
+        const size_t tiles = rules.size();
+        auto& allowed = region.m_possibleNeighbors[0];
+        auto& backup = region.m_possibleNeighbors[1];
+
+        // dir points from the region's cell to the cell outside
+        auto restrict = [&]( size_t rx, size_t ry, int dir )
         {
-            if ( n )
+            size_t outside;
+            if ( !getNeighborId( fieldIndex( x + rx, y + ry ), dir, outside ) || m_entropy.count( outside ) == tiles )
             {
-                return false;
+                return;
+            }
+
+            const int rev = revDir( dir );
+            allowed.reset( false );
+            readCell( outside ).forEach( [&]( size_t i )
+            {
+                allowed.add( rules.m_neighborSets[i * Directions + rev] );
+            } );
+
+            const Cell cell = region.m_field[region.fieldIndex( rx, ry )];
+            backup.reset( false );
+            backup.add( cell );
+            if ( cell.intersectCount( allowed ) == 0 )
+            {
+                // the cells around contradict each other, leave the cell as it was
+                cell.add( backup );
             }
+        };
+
+        for ( size_t rx = 0; rx < width && !(region.m_wrap & WrapY); ++rx )
+        {
+            restrict( rx, 0, Up );
+            restrict( rx, height - 1, Down );
+        }
+        for ( size_t ry = 0; ry < height && !(region.m_wrap & WrapX); ++ry )
+        {
+            restrict( 0, ry, Left );
+            restrict( width - 1, ry, Right );
+        }
+
+        region.collapseRestricted();
+
+        for ( size_t ry = 0; ry < height; ++ry )
+        {
+            for ( size_t rx = 0; rx < width; ++rx )
+            {
+                const size_t id = fieldIndex( x + rx, y + ry );
+                storeCell( id, region.readCell( region.fieldIndex( rx, ry ) ) );
+                updateCount( id, readCell( id ).count() );
+                m_collapsed[id] = region.m_collapsed[region.fieldIndex( rx, ry )];
+            }
+        }
+
+        m_backtracks += region.m_backtracks;
+        m_restarts += region.m_restarts;
+        C011APSY_STAT( mergeStats( region.m_stats ) );
+
+        // the old decisions refer to the old tiles
+        clearTrail();
+        if ( m_propagation == Supports && !m_entropy.empty() )
+        {
+            // the counters around the region are stale, recount them before the next step
+            m_indexDirty = true;
         }
-        return true;
     }
 
-    inline
-    size_t Bitset::count() const
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::collapseRestricted()
     {
-        size_t result = 0;
-        for ( uint64_t n : m_data )
+        // the supports are recounted from scratch and spread the restrictions on their own
+        rebuildIndex();
+
+        if ( m_propagation == Bitsets )
         {
-            while ( n )
+            // same as rebuildIndex(), the borders are the starting point, nothing to undo there
+            const bool gaveUp = m_gaveUp;
+            m_gaveUp = true;
+
+            beginVisit();
+            for ( size_t x = 0; x < m_fieldW; ++x )
+            {
+                m_wavefront.push_back( static_cast<uint32_t>( fieldIndex( x, 0 ) ) );
+                m_wavefront.push_back( static_cast<uint32_t>( fieldIndex( x, m_fieldH - 1 ) ) );
+            }
+            for ( size_t y = 0; y < m_fieldH; ++y )
             {
-                n &= (n - 1);
-                result++;
+                m_wavefront.push_back( static_cast<uint32_t>( fieldIndex( 0, y ) ) );
+                m_wavefront.push_back( static_cast<uint32_t>( fieldIndex( m_fieldW - 1, y ) ) );
             }
+            propagateConstraints();
+
+            m_gaveUp = gaveUp;
         }
-        return result;
+
+        collapse( false );
     }
 
-    inline
-    bool Bitset::single() const
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::collapseStep( size_t id0, Callback c )
+    {
+        if ( m_indexDirty )
+        {
+            rebuildIndex();
+        }
+
+        if ( m_stepPending )
+        {
+            finishStep( c, nullptr );
+        }
+
+        beginStep( id0, c );
+        finishStep( c, nullptr );
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::beginStep( size_t id0, Callback c )
     {
-        bool result = false;
-        for ( uint64_t n : m_data )
+        m_changed = true;
+        C011APSY_STAT( ++m_stats.collapses );
+        const size_t trail = m_trail.size();
+        const size_t tile = collapseCell( id0 );
+        if ( isRecording() && !m_conflict )
+        {
+            m_decisions.push_back( { static_cast<uint32_t>( id0 ), static_cast<uint32_t>( tile ), trail } );
+        }
+
+        notify( c, id0 );
+
+        if ( m_propagation == Bitsets )
         {
-            if ( n )
+            beginVisit();
+            if ( !m_conflict )
             {
-                if ( result || (n & (n - 1)) )
-                {
-                    return false;
-                }
-                result = true;
+                propagate( id0 );
             }
         }
-        return result;
+
+        m_stepPending = true;
     }
 
-    inline
-    size_t Bitset::first() const
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    bool Wave<T, MaxTiles, Topology, Random>::finishStep( Callback c, const Clock::time_point* deadline )
+    {
+        // the supports may change with no cell changed
+        m_changed = true;
+        const bool done = m_propagation == Supports ? propagateSupports( c, deadline ) : propagateBitsets( c, deadline );
+        if ( !done )
+        {
+            return false;
+        }
+
+        m_stepPending = false;
+        if ( m_conflict )
+        {
+            resolve( c );
+        }
+        return true;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    bool Wave<T, MaxTiles, Topology, Random>::isRecording() const
+    {
+        return m_contradiction == Backtrack && !m_gaveUp;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::record( size_t id, const uint64_t* words )
+    {
+        m_trail.emplace_back( static_cast<uint32_t>( id ), 0 );
+        m_trailWords.insert( m_trailWords.end(), words, words + m_field.stride() );
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::undo( size_t trail )
     {
-        size_t step = 0;
-        for ( uint64_t n : m_data )
+        const RuleSet& rules = *m_rules;
+        const size_t stride = m_field.stride();
+
+        while ( m_trail.size() > trail )
         {
-            if ( n )
+            const size_t id = m_trail.back().first;
+            const size_t tile = m_trail.back().second;
+            m_trail.pop_back();
+
+            if ( m_propagation == Supports )
             {
-                uint8_t bit = 0;
-                while ( (n & 1) == 0 )
+                // every logged removal was propagated, give the supports back
+                m_field[id].set( tile, true );
+                for ( int dir = 0; dir < Directions; ++dir )
                 {
-                    ++bit;
-                    n >>= 1;
+                    size_t neighbor;
+                    if ( !getNeighborId( id, dir, neighbor ) )
+                    {
+                        continue;
+                    }
+
+                    const int rev = revDir( dir );
+                    const size_t begin = rules.m_adjacencyOffsets[tile * Directions + dir];
+                    const size_t end = rules.m_adjacencyOffsets[tile * Directions + dir + 1];
+                    for ( size_t i = begin; i < end; ++i )
+                    {
+                        ++support( neighbor, rules.m_adjacency[i], rev );
+                    }
                 }
-                return step + bit;
             }
-            step += Stride;
+            else
+            {
+                memcpy( m_field[id].data(), &m_trailWords[m_trail.size() * stride], sizeof( uint64_t ) * stride );
+                m_trailWords.resize( m_trail.size() * stride );
+            }
+
+            const size_t count = readCell( id ).count();
+            updateCount( id, count );
+            m_collapsed[id] = count == 1;
         }
-        return m_size;
+
+        m_trailMark = std::min( m_trailMark, m_trail.size() );
     }
 
-    template<class T>
-    struct Wave<T>::Neighbors
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::resolve( Callback c )
     {
-        Neighbors( size_t tiles )
-            : up( tiles )
-            , down( tiles )
-            , left( tiles )
-            , right( tiles )
+        while ( m_conflict )
         {
+            m_conflict = false;
+
+            if ( !m_decisions.empty() && m_runBacktracks < m_maxBacktracks )
+            {
+                // the latest decision was wrong, forbid its tile. It's a consequence of the previous decision
+                const Decision decision = m_decisions.back();
+                m_decisions.pop_back();
+                m_decisionsMark = std::min( m_decisionsMark, m_decisions.size() );
+                undo( decision.trail );
+
+                ++m_backtracks;
+                ++m_runBacktracks;
+                banTile( decision.cell, decision.tile, c );
+                continue;
+            }
+
+            // start over, the random generator will lead somewhere else this time
+            undo( 0 );
+            m_decisions.clear();
+            m_decisionsMark = 0;
+            m_runBacktracks = 0;
+
+            if ( m_restarts < m_maxRestarts )
+            {
+                ++m_restarts;
+            }
+            else
+            {
+                // the rest is solved the old way
+                m_gaveUp = true;
+                clearTrail();
+            }
         }
+    }
 
-        const Bitset& operator[]( int dir ) const
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::banTile( size_t id, size_t tile, Callback c )
+    {
+        const size_t count = m_entropy.count( id );
+        if ( count <= 1 )
         {
-            assert( dir >= Up && dir <= Right && "Neighbors::operator[] wrong direction" );
-            return const_cast<Neighbors*>(this)->operator[]( dir );
+            C011APSY_STAT( ++m_stats.contradictions );
+            m_conflict = true;
+            return;
         }
 
-        Bitset& operator[]( int dir )
+        if ( m_propagation == Supports )
         {
-            assert( dir >= Up && dir <= Right && "Neighbors::operator[] wrong direction" );
-            switch ( dir )
-            {
-            case Up:
-                return up;
-            case Down:
-                return down;
-            case Left:
-                return left;
-            }
-            return right;
+            removeTile( id, tile );
+            propagateSupports( c );
+            return;
         }
 
-        Bitset up;
-        Bitset down;
-        Bitset left;
-        Bitset right;
-    };
+        record( id, m_field[id].data() );
+        m_field[id].set( tile, false );
+        updateCount( id, count - 1 );
+        if ( count - 1 == 1 )
+        {
+            m_collapsed[id] = true;
+        }
 
-    template<class T>
-    struct Wave<T>::Seed
-    {
-        std::vector<T> tiles;
-        std::vector<uint32_t> weights;
-        std::vector<Neighbors> neighbors;
-        size_t rndSeed = 0;
-    };
+        beginVisit();
+        propagate( id );
+        propagateBitsets( c );
+    }
 
-    template<class T>
-    Wave<T>::Wave( size_t width, size_t height )
-        : m_allTiles( 1 )
-        , m_fieldW( width )
-        , m_fieldH( height )
-        , m_uncertaintyCurrent( width * height )
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::clearTrail()
     {
+        m_trail.clear();
+        m_trailWords.clear();
+        m_decisions.clear();
+        m_conflict = false;
+        m_runBacktracks = 0;
+        m_trailMark = 0;
+        m_decisionsMark = 0;
     }
 
-    template<class T>
-    void Wave<T>::init( const Seed& seed )
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    bool Wave<T, MaxTiles, Topology, Random>::propagateBitsets( Callback c, const Clock::time_point* deadline )
     {
-        assert( !seed.tiles.empty() && "Wave::init() empty seed tiles" );
-        assert( seed.tiles.size() == seed.weights.size() && "Wave::init() tiles and weights size mismatch" );
-        assert( seed.tiles.size() == seed.neighbors.size() && "Wave::init() tiles and neighbors size mismatch" );
+        C011APSY_STAT( detail::ScopedTimer timer( m_stats.propagation ) );
+        size_t processed = 0;
+        while ( m_wavefrontHead < m_wavefront.size() )
+        {
+            // the clock is not that cheap to query for every cell
+            if ( deadline && ++processed % 16 == 0 && Clock::now() >= *deadline )
+            {
+                return false;
+            }
 
-        m_seed = seed;
-        initRandom();
-        initField();
+            const size_t currentId = m_wavefront[m_wavefrontHead++];
+            C011APSY_STAT( ++m_stats.pops );
+
+            if ( isVisited( currentId ) )
+            {
+                continue;
+            }
+
+            m_visited[currentId] = m_visitEpoch;
+
+            const size_t initialVariance = m_entropy.count( currentId );
+
+            if ( initialVariance == 1 )
+            {
+                continue;
+            }
+
+            const size_t variance = filterCandidates( currentId );
+            updateCount( currentId, variance );
+
+            if ( variance == 0 && isRecording() )
+            {
+                m_conflict = true;
+                return true;
+            }
+
+            if ( initialVariance != variance )
+            {
+                if ( variance == 1 )
+                {
+                    m_collapsed[currentId] = true;
+                }
+                propagate( currentId );
+            }
+
+            notify( c, currentId );
+        }
+
+        return true;
     }
 
-    template<class T>
-    void Wave<T>::init(
-        const std::vector<T>& pattern,
-        size_t patternWidth, size_t patternHeight,
-        size_t tileWidth, size_t tileHeight,
-        size_t rndSeed )
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::propagateConstraints()
     {
-        assert( patternWidth * patternHeight <= pattern.size() && "Wave::init() pattern size mismatch" );
-        assert( tileWidth <= patternWidth && tileHeight <= patternHeight && "Wave::init() wrong tile dimensions" );
+        const RuleSet& rules = *m_rules;
+        auto& allowed = m_possibleNeighbors[0];
+        auto& kept = m_possibleNeighbors[1];
 
-        std::vector<std::vector<T>> tiles;
+        // m_visited marks the cells waiting in m_wavefront, the mark is taken off once the cell is processed
+        const uint32_t queued = m_visitEpoch;
+        for ( size_t i = m_wavefrontHead; i < m_wavefront.size(); ++i )
+        {
+            m_visited[m_wavefront[i]] = queued;
+        }
 
-        for ( size_t x = 0; x <= patternWidth - tileWidth; ++x )
+        while ( m_wavefrontHead < m_wavefront.size() )
         {
-            for ( size_t y = 0; y <= patternHeight - tileHeight; ++y )
-            {
-                size_t startId = y * patternWidth + x;
+            const size_t id0 = m_wavefront[m_wavefrontHead++];
+            m_visited[id0] = queued - 1;
+            C011APSY_STAT( ++m_stats.pops );
 
-                std::vector<T> tile( tileWidth * tileHeight );
+            detail::unroll<Directions>( [&]( int dir )
+            {
+                size_t id;
+                if ( !getNeighborId( id0, dir, id ) )
+                {
+                    return;
+                }
 
-                for ( size_t i = 0; i < tileHeight; ++i )
+                const size_t count = m_entropy.count( id );
+                if ( count <= 1 )
                 {
-                    memcpy( &tile[i * tileWidth], &pattern[startId], sizeof( T ) * tileWidth );
-                    startId += patternWidth;
+                    return;
                 }
 
-                auto findIt = std::find( tiles.begin(), tiles.end(), tile );
-                if ( findIt == tiles.end() )
+                // the tiles the neighbor could have next to id0
+                allowed.reset( false );
+                readCell( id0 ).forEach( [&]( size_t i )
+                {
+                    allowed.add( rules.m_neighborSets[i * Directions + dir] );
+                } );
+
+                kept.reset( false );
+                kept.add( readCell( id ) );
+                const size_t variance = kept.intersectCount( allowed );
+                if ( variance == 0 )
                 {
-                    m_seed.weights.push_back( 1 );
-                    m_seed.tiles.push_back( tile[0] );
-                    tiles.emplace_back( std::move( tile ) );
+                    // the cells around contradict each other, leave the cell as it was
+                    C011APSY_STAT( ++m_stats.contradictions );
+                    return;
                 }
-                else
+
+                if ( variance < count )
                 {
-                    m_seed.weights[std::distance( tiles.begin(), findIt )] += 1;
+                    storeCell( id, kept );
+                    updateCount( id, variance );
+                    m_collapsed[id] = variance == 1;
+                    if ( m_visited[id] != queued )
+                    {
+                        m_visited[id] = queued;
+                        m_wavefront.push_back( static_cast<uint32_t>( id ) );
+                    }
                 }
+            } );
+            C011APSY_STAT( m_stats.peakWavefront = std::max( m_stats.peakWavefront, m_wavefront.size() - m_wavefrontHead ) );
+
+            // the cells could be queued many times, don't let the processed ones pile up
+            if ( m_wavefrontHead >= 4096 && m_wavefrontHead * 2 >= m_wavefront.size() )
+            {
+                m_wavefront.erase( m_wavefront.begin(), m_wavefront.begin() + static_cast<std::ptrdiff_t>( m_wavefrontHead ) );
+                m_wavefrontHead = 0;
             }
         }
 
-        m_seed.neighbors.resize( tiles.size(), Neighbors( tiles.size() ) );
-        for ( size_t i = 0; i < tiles.size(); ++i )
+        m_wavefront.clear();
+        m_wavefrontHead = 0;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    size_t Wave<T, MaxTiles, Topology, Random>::collapseCell( size_t id )
+    {
+        if ( m_propagation == Bitsets && filterCandidates( id ) == 0 && isRecording() )
+        {
+            updateCount( id, 0 );
+            m_conflict = true;
+            return m_field[id].size();
+        }
+        const auto cell = m_field[id];
+        const size_t startTile = pickTile( cell );
+
+        if ( m_propagation == Supports )
         {
-            const auto& tile = tiles[i];
-            for ( int dir = 0; dir < 4; ++dir )
+            cell.forEach( [&]( size_t i )
             {
-                for ( size_t j = i; j < tiles.size(); ++j )
+                if ( i != startTile )
                 {
-                    if ( isNeighbor( tile, tiles[j], Dir( dir ), tileWidth, tileHeight ) )
-                    {
-                        m_seed.neighbors[i][dir].set( j, true );
-                        m_seed.neighbors[j][revDir( dir )].set( i, true );
-                    }
+                    removeTile( id, i );
+                }
+            } );
+            return startTile;
+        }
+
+        if ( isRecording() )
+        {
+            record( id, cell.data() );
+        }
+        m_field[id].reset( false );
+        m_field[id].set( startTile, true );
+        m_collapsed[id] = true;
+        updateCount( id, 1 );
+        return startTile;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    size_t Wave<T, MaxTiles, Topology, Random>::pickTile( ConstCell cell )
+    {
+        const auto& weights = m_rules->getWeights();
+
+        double total = 0.0;
+        size_t options = 0;
+        cell.forEach( [&]( size_t i )
+        {
+            total += weights[i];
+            ++options;
+        } );
+
+        assert( options > 0 && "Wave::pickTile() no tiles to pick from" );
+
+        size_t result = cell.size();
+        if ( total > 0.0 )
+        {
+            double target = detail::unitReal( m_random ) * total;
+
+            cell.forEach( [&]( size_t i )
+            {
+                // the last tile with a non-zero weight also takes whatever is left by the rounding errors
+                if ( target >= 0.0 && weights[i] > 0.0 )
+                {
+                    result = i;
+                    target -= weights[i];
+                }
+            } );
+        }
+        else
+        {
+            // no weights to rely on, every tile is equally likely
+            size_t target = static_cast<size_t>( detail::bounded( m_random, options ) );
+
+            cell.forEach( [&]( size_t i )
+            {
+                if ( target-- == 0 )
+                {
+                    result = i;
                 }
+            } );
+        }
+
+        return result;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    size_t Wave<T, MaxTiles, Topology, Random>::filterCandidates( size_t id )
+    {
+        C011APSY_STAT( ++m_stats.filters );
+        Cell candidates = m_field[id];
+
+        const bool recording = isRecording();
+        if ( recording )
+        {
+            m_snapshot.assign( candidates.data(), candidates.data() + m_field.stride() );
+        }
+
+        if ( candidates.empty() )
+        {
+            candidates.reset( true );
+        }
+
+        const RuleSet& rules = *m_rules;
+        const size_t tiles = rules.size();
+        size_t count = tiles;
+
+        // the directions are unrolled, so the neighbor lookup is resolved at compile time for each one
+        detail::unroll<Directions>( [&]( int dir )
+        {
+            size_t neighbor;
+            if ( !getNeighborId( id, dir, neighbor ) || m_entropy.count( neighbor ) == tiles )
+            {
+                // nothing to compute, the neighbor is the same as the one outside the field
+                m_possibleNeighbors[dir] = rules.m_openNeighbors[dir];
+            }
+            else
+            {
+                const int rev = revDir( dir );
+                m_possibleNeighbors[dir].reset( false );
+                readCell( neighbor ).forEach( [&]( size_t i )
+                {
+                    m_possibleNeighbors[dir].add( rules.m_neighborSets[i * Directions + rev] );
+                } );
+            }
+            count = candidates.intersectCount( m_possibleNeighbors[dir] );
+        } );
+
+        C011APSY_STAT( m_stats.contradictions += count == 0 ? 1 : 0 );
+
+        if ( recording )
+        {
+            // only the tiles are removed, so the same count means the same content
+            if ( count != m_entropy.count( id ) )
+            {
+                record( id, m_snapshot.data() );
+            }
+            return count;
+        }
+
+        if ( count == 0 )
+        {
+            for ( int i = 0; i < Directions; ++i )
+            {
+                candidates.add( m_possibleNeighbors[i] );
             }
+            count = candidates.count();
         }
 
-        m_seed.rndSeed = rndSeed;
-        initRandom();
-        initField();
+        return count;
     }
 
-    template<class T>
-    typename Wave<T>::Seed& Wave<T>::getSeed()
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    size_t Wave<T, MaxTiles, Topology, Random>::getCollapsePoint()
     {
-        return m_seed;
+        C011APSY_STAT( detail::ScopedTimer timer( m_stats.selection ) );
+        return m_entropy.pick( m_random );
     }
 
-    template<class T>
-    typename Wave<T>::Field& Wave<T>::getField()
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::updateCount( size_t id, size_t count )
     {
-        return m_field;
+        C011APSY_STAT( m_stats.bitsRemoved += count < m_entropy.count( id ) ? m_entropy.count( id ) - count : 0 );
+        m_uncertaintyCurrent -= m_entropy.count( id );
+        m_uncertaintyCurrent += count;
+        m_entropy.update( id, count );
+
+        if ( m_field.compact() && (count <= 1 || count == m_rules->size()) )
+        {
+            m_field.shrink( id );
+        }
+
+        logChange( id, count );
     }
 
-    template<class T>
-    const std::vector<T>& Wave<T>::getTiles() const
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::logChange( size_t id, size_t count )
     {
-        return m_seed.tiles;
+        if ( m_chain )
+        {
+            m_dirty.add( id );
+            m_changed = true;
+        }
+        if ( m_journal )
+        {
+            m_changes.push_back( { static_cast<uint32_t>( id ), static_cast<uint32_t>( count ) } );
+        }
+        if ( m_output && count == 1 )
+        {
+            const size_t stride = m_outputStride ? m_outputStride : m_fieldW * sizeof( T );
+            T* row = reinterpret_cast<T*>( reinterpret_cast<char*>( m_output ) + (id / m_fieldW) * stride );
+            row[id % m_fieldW] = m_rules->getTiles()[m_field.first( id )];
+        }
     }
 
-    template<class T>
-    size_t Wave<T>::getFieldWidth() const
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::notify( Callback c, size_t id )
     {
-        return m_fieldW;
+        if ( c )
+        {
+            c( *this, id % m_fieldW, id / m_fieldW );
+        }
+        if ( m_observer )
+        {
+            m_observer( m_observerContext, *this, id % m_fieldW, id / m_fieldW );
+        }
     }
 
-    template<class T>
-    size_t Wave<T>::getFieldHeight() const
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    typename Wave<T, MaxTiles, Topology, Random>::ConstCell Wave<T, MaxTiles, Topology, Random>::readCell( size_t id ) const
     {
-        return m_fieldH;
+        return m_field[id];
     }
 
-    template<class T>
-    float Wave<T>::getProgress() const
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::storeCell( size_t id, ConstCell value )
     {
-        const size_t uncertaintyMax = m_field.size() * m_seed.tiles.size();
-        const size_t uncertaintyMin = m_field.size();
-        const float progress = ( uncertaintyMax - m_uncertaintyCurrent ) / static_cast<float>( uncertaintyMax - uncertaintyMin );
-        return progress * 100.f;
+        const Cell cell = m_field[id];
+        cell.reset( false );
+        cell.add( value );
+        m_field.shrink( id );
     }
 
-    template<class T>
-    bool Wave<T>::collapse( bool oneStep, Callback c )
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::rebuildIndex()
     {
-        assert( !m_field.empty() && "Wave::collapse() wave is not initialized properly" );
+        m_entropy.reset( m_field.size(), m_rules->size() );
+        m_uncertaintyCurrent = m_field.size() * m_rules->size();
 
-        m_uncertaintyCurrent = m_field.size();
-        size_t id0 = getCollapsePoint( m_uncertaintyCurrent );
+        // it's a recount, the tiles were removed before
+        C011APSY_STAT( const size_t bitsRemoved = m_stats.bitsRemoved );
+        for ( size_t i = 0; i < m_field.size(); ++i )
+        {
+            const size_t count = readCell( i ).count();
+            updateCount( i, count );
+            if ( count == 1 )
+            {
+                m_collapsed[i] = true;
+            }
+        }
+        C011APSY_STAT( m_stats.bitsRemoved = bitsRemoved );
+
+        m_indexDirty = false;
 
-        while ( m_uncertaintyCurrent > m_field.size() )
+        if ( m_propagation == Supports )
         {
-            collapseStep( id0, c );
-            id0 = getCollapsePoint( m_uncertaintyCurrent );
+            // the contradictions of the starting point can't be undone, they are handled as Contradiction::Fallback
+            const bool gaveUp = m_gaveUp;
+            m_gaveUp = true;
+            initSupports();
+            m_gaveUp = gaveUp;
+        }
+
+        // the field is a new starting point now
+        clearTrail();
+    }
 
-            if ( oneStep )
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::markCheckpoint()
+    {
+        m_dirty.clear();
+        m_entropy.moved().clear();
+        if ( m_stepPending && m_propagation == Supports )
+        {
+            // the pending removals are yet to change the supports around them
+            for ( const auto& removal : m_removals )
             {
-                return m_uncertaintyCurrent == m_field.size();
+                m_dirty.add( removal.first );
             }
         }
 
-        return true;
+        m_trailMark = m_trail.size();
+        m_decisionsMark = m_decisions.size();
+        m_changed = false;
     }
 
-    template<class T>
-    void Wave<T>::collapseStep( size_t id0, Callback c )
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::propagate( size_t id0 )
     {
-        collapseCell( id0 );
-        if ( c )
+        auto push = [&]( size_t id )
         {
-            c( *this, id0 % m_fieldW, id0 / m_fieldW );
-        }
+            if ( !isVisited( id ) && m_entropy.count( id ) != 1 )
+            {
+                m_wavefront.push_back( static_cast<uint32_t>( id ) );
+            }
+        };
 
-        std::queue<size_t> collapseFront;
+        detail::unroll<Directions>( [&]( int dir )
+        {
+            size_t neighbor;
+            if ( getNeighborId( id0, dir, neighbor ) )
+            {
+                push( neighbor );
+            }
+        } );
+        C011APSY_STAT( m_stats.peakWavefront = std::max( m_stats.peakWavefront, m_wavefront.size() - m_wavefrontHead ) );
+    }
 
-        m_visited = m_collapsed;
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    bool Wave<T, MaxTiles, Topology, Random>::isVisited( size_t id ) const
+    {
+        return m_collapsed[id] || m_visited[id] == m_visitEpoch;
+    }
 
-        propagate( id0, collapseFront );
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::beginVisit()
+    {
+        m_wavefront.clear();
+        m_wavefrontHead = 0;
 
-        while ( !collapseFront.empty() )
+        if ( ++m_visitEpoch == 0 )
         {
-            const size_t currentId = collapseFront.front();
-            collapseFront.pop();
+            // the counter wrapped around, old marks could be mistaken for the new ones
+            std::fill( m_visited.begin(), m_visited.end(), 0 );
+            m_visitEpoch = 1;
+        }
+    }
 
-            if ( m_visited[currentId] )
-            {
-                continue;
-            }
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::removeTile( size_t id, size_t tile )
+    {
+        m_field[id].set( tile, false );
+
+        const size_t count = m_entropy.count( id ) - 1;
+        m_entropy.update( id, count );
+        --m_uncertaintyCurrent;
 
-            m_visited[currentId] = true;
+        if ( count == 1 )
+        {
+            m_collapsed[id] = true;
+            m_field.shrink( id );
+        }
 
-            const auto& place = m_field[currentId];
-            const size_t initialVariance = place.count();
+        logChange( id, count );
 
-            if ( initialVariance == 1 )
+        m_removals.emplace_back( static_cast<uint32_t>( id ), static_cast<uint32_t>( tile ) );
+        C011APSY_STAT( ++m_stats.bitsRemoved );
+        C011APSY_STAT( m_stats.peakWavefront = std::max( m_stats.peakWavefront, m_removals.size() ) );
+        if ( isRecording() )
+        {
+            m_trail.emplace_back( static_cast<uint32_t>( id ), static_cast<uint32_t>( tile ) );
+        }
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    bool Wave<T, MaxTiles, Topology, Random>::propagateSupports( Callback c, const Clock::time_point* deadline )
+    {
+        C011APSY_STAT( detail::ScopedTimer timer( m_stats.propagation ) );
+        const RuleSet& rules = *m_rules;
+        size_t processed = 0;
+        while ( !m_removals.empty() )
+        {
+            if ( deadline && ++processed % 16 == 0 && Clock::now() >= *deadline )
             {
-                continue;
+                return false;
             }
 
-            filterCandidates( currentId );
+            const size_t id0 = m_removals.back().first;
+            const size_t removed = m_removals.back().second;
+            m_removals.pop_back();
+            C011APSY_STAT( ++m_stats.pops );
 
-            const size_t variance = place.count();
-            if ( initialVariance != variance )
+            for ( int dir = 0; dir < Directions; ++dir )
             {
-                if ( variance == 1 )
+                size_t id;
+                if ( !getNeighborId( id0, dir, id ) )
                 {
-                    m_collapsed[currentId] = true;
+                    continue;
                 }
-                propagate( currentId, collapseFront );
-            }
 
-            if ( c )
-            {
-                c( *this, currentId % m_fieldW, currentId / m_fieldW );
-            }
-        }
-    }
+                // the neighbor sees the removed tile from the opposite side
+                const int rev = revDir( dir );
+                const size_t begin = rules.m_adjacencyOffsets[removed * Directions + dir];
+                const size_t end = rules.m_adjacencyOffsets[removed * Directions + dir + 1];
+                bool changed = false;
 
-    template<class T>
-    void Wave<T>::collapseCell( size_t id )
-    {
-        filterCandidates( id );
-        const auto& cell = m_field[id];
-        m_collapseCandidates.clear();
+                for ( size_t i = begin; i < end; ++i )
+                {
+                    const size_t tile = rules.m_adjacency[i];
+                    if ( --support( id, tile, rev ) == 0 && readCell( id )[tile] && !m_conflict )
+                    {
+                        // the last possible tile is kept even though it breaks the rules,
+                        // same as the union fallback of filterCandidates()
+                        if ( m_entropy.count( id ) > 1 )
+                        {
+                            removeTile( id, tile );
+                            changed = true;
+                        }
+                        else
+                        {
+                            C011APSY_STAT( ++m_stats.contradictions );
+                            if ( isRecording() )
+                            {
+                                // the rest of the removals only update the supports, so every logged removal
+                                // is propagated exactly once and could be undone
+                                m_conflict = true;
+                            }
+                        }
+                    }
+                }
 
-        for ( size_t i = 0; i < cell.size(); ++i )
-        {
-            if ( cell[i] )
-            {
-                m_collapseCandidates.insert( m_collapseCandidates.end(), m_seed.weights[i], i );
+                if ( changed )
+                {
+                    notify( c, id );
+                }
             }
         }
 
-        std::uniform_int_distribution<size_t> rnd( 0, m_collapseCandidates.size() - 1 );
-        size_t startTile = m_collapseCandidates[rnd( *m_mt )];
-
-        m_field[id].reset( false );
-        m_field[id].set( startTile, true );
-        m_collapsed[id] = true;
+        return true;
     }
 
-    template<class T>
-    void Wave<T>::filterCandidates( size_t id )
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::initSupports()
     {
-        Bitset& candidates = m_field[id];
-        if ( candidates.empty() )
+        const RuleSet& rules = *m_rules;
+        const size_t tiles = rules.size();
+        assert( tiles <= UINT16_MAX && "Wave::initSupports() too many tiles" );
+
+        m_supports.resize( m_field.size() * tiles * Directions );
+        m_removals.clear();
+
+        auto isOpen = [&]( size_t id, int dir )
         {
-            candidates.reset( true );
-        }
+            size_t neighbor;
+            return !getNeighborId( id, dir, neighbor ) || m_entropy.count( neighbor ) == tiles;
+        };
 
-        for ( int dir = 0; dir < 4; ++dir )
+        for ( size_t id = 0; id < m_field.size(); ++id )
         {
-            m_possibleNeighbors[dir].reset( false );
-            const auto& cellNeighbors = getNeighbor( id % m_fieldW, id / m_fieldW, dir );
-            for ( size_t i = 0; i < cellNeighbors.size(); ++i )
+            // the fast path for the most common case of a cell surrounded by the untouched ones.
+            // Every direction counts, Grid3D and HexGrid have more than the four
+            bool open = true;
+            for ( int dir = 0; dir < Directions && open; ++dir )
             {
-                if ( cellNeighbors[i] )
+                open = isOpen( id, dir );
+            }
+            if ( open )
+            {
+                memcpy( &support( id, 0, 0 ), rules.m_fullSupports.data(), sizeof( uint16_t ) * tiles * Directions );
+                continue;
+            }
+
+            for ( int dir = 0; dir < Directions; ++dir )
+            {
+                size_t neighbor = 0;
+                if ( isOpen( id, dir ) )
+                {
+                    for ( size_t tile = 0; tile < tiles; ++tile )
+                    {
+                        support( id, tile, dir ) = rules.m_fullSupports[tile * Directions + dir];
+                    }
+                    continue;
+                }
+                getNeighborId( id, dir, neighbor );
+
+                for ( size_t tile = 0; tile < tiles; ++tile )
                 {
-                    const auto& neighbors = m_seed.neighbors[i][revDir( dir )];
-                    m_possibleNeighbors[dir].add( neighbors );
+                    support( id, tile, dir ) = 0;
                 }
+
+                // the cell is seen from the neighbor in the opposite direction
+                const int rev = revDir( dir );
+                readCell( neighbor ).forEach( [&]( size_t other )
+                {
+                    const size_t begin = rules.m_adjacencyOffsets[other * Directions + rev];
+                    const size_t end = rules.m_adjacencyOffsets[other * Directions + rev + 1];
+                    for ( size_t i = begin; i < end; ++i )
+                    {
+                        ++support( id, rules.m_adjacency[i], dir );
+                    }
+                } );
             }
-            candidates.intersect( m_possibleNeighbors[dir] );
         }
 
-        if ( candidates.empty() )
+        assert( supportsCounted() && "Wave::initSupports() the supports don't match the field" );
+
+        for ( size_t id = 0; id < m_field.size(); ++id )
         {
-            for ( size_t i = 0; i < 4; ++i )
+            readCell( id ).forEach( [&]( size_t tile )
             {
-                candidates.add( m_possibleNeighbors[i] );
-            }
+                if ( m_entropy.count( id ) == 1 )
+                {
+                    return;
+                }
+
+                for ( int dir = 0; dir < Directions; ++dir )
+                {
+                    if ( support( id, tile, dir ) == 0 )
+                    {
+                        removeTile( id, tile );
+                        break;
+                    }
+                }
+            } );
         }
+
+        propagateSupports( nullptr );
     }
 
-    template<class T>
-    size_t Wave<T>::getCollapsePoint( size_t& totalUncertainty ) const
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    bool Wave<T, MaxTiles, Topology, Random>::supportsCounted()
     {
-        std::vector<size_t> uncollapsed;
-        size_t uncollapsedMax = m_seed.tiles.size();
+        const RuleSet& rules = *m_rules;
+        const size_t tiles = rules.size();
 
-        totalUncertainty = 0;
-        for ( size_t i = 0; i < m_field.size(); ++i )
+        std::vector<uint16_t> expected( tiles );
+        for ( size_t id = 0; id < m_field.size(); ++id )
         {
-            const size_t len = m_field[i].count();
-            totalUncertainty += len;
-
-            if ( len > 1 )
+            for ( int dir = 0; dir < Directions; ++dir )
             {
-                if ( len <= uncollapsedMax )
+                size_t neighbor;
+                const bool inside = getNeighborId( id, dir, neighbor );
+                for ( size_t tile = 0; tile < tiles; ++tile )
+                {
+                    expected[tile] = inside ? 0 : rules.m_fullSupports[tile * Directions + dir];
+                }
+
+                if ( inside )
                 {
-                    if ( len == uncollapsedMax )
+                    const int rev = revDir( dir );
+                    readCell( neighbor ).forEach( [&]( size_t other )
                     {
-                        uncollapsed.push_back( i );
-                    }
-                    else
+                        const size_t begin = rules.m_adjacencyOffsets[other * Directions + rev];
+                        const size_t end = rules.m_adjacencyOffsets[other * Directions + rev + 1];
+                        for ( size_t i = begin; i < end; ++i )
+                        {
+                            ++expected[rules.m_adjacency[i]];
+                        }
+                    } );
+                }
+
+                for ( size_t tile = 0; tile < tiles; ++tile )
+                {
+                    if ( support( id, tile, dir ) != expected[tile] )
                     {
-                        uncollapsed.resize( 1 );
-                        uncollapsed[0] = i;
+                        return false;
                     }
-                    uncollapsedMax = len;
                 }
             }
         }
 
-        if ( !uncollapsed.empty() )
+        return true;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    uint16_t& Wave<T, MaxTiles, Topology, Random>::support( size_t id, size_t tile, int dir )
+    {
+        return m_supports[(id * m_rules->size() + tile) * Directions + dir];
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    typename Wave<T, MaxTiles, Topology, Random>::ConstCell Wave<T, MaxTiles, Topology, Random>::getNeighbor( size_t x, size_t y, int dir ) const
+    {
+        size_t neighbor;
+        if ( getNeighborId( fieldIndex( x, y ), dir, neighbor ) )
         {
-            std::uniform_int_distribution<size_t> rnd( 0, uncollapsed.size() - 1 );
-            return uncollapsed[rnd( *m_mt )];
+            return m_field[neighbor];
         }
 
-        return 0;
+        return m_rules->m_allTiles;
     }
 
-    template<class T>
-    void Wave<T>::propagate(
-        size_t id0,
-        std::queue<size_t>& wavefront )
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    inline
+    bool Wave<T, MaxTiles, Topology, Random>::getNeighborId( size_t id, int dir, size_t& neighbor ) const
     {
-        auto push = [&]( size_t id )
+        return Topology::neighbor( id, dir, m_fieldW, m_fieldH, m_fieldD, m_wrap, neighbor );
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    int Wave<T, MaxTiles, Topology, Random>::revDir( int dir )
+    {
+        static_assert( Directions >= 4 && Directions % 2 == 0, "Wave topology directions must go in pairs" );
+        return dir ^ 1;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    bool Wave<T, MaxTiles, Topology, Random>::isSeam( size_t x, size_t y, size_t chunkSize ) const
+    {
+        // the last row/column of a chunk is a seam, unless it's the field boundary
+        return ( x % chunkSize == chunkSize - 1 && x < m_fieldW - 1 )
+            || ( y % chunkSize == chunkSize - 1 && y < m_fieldH - 1 )
+            // the last column touches the first chunk across the wrapped edge, same for the last row
+            || ( (m_wrap & WrapX) && x == m_fieldW - 1 && m_fieldW > chunkSize )
+            || ( (m_wrap & WrapY) && y == m_fieldH - 1 && m_fieldH > chunkSize );
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::loadRegion( const Wave& src, size_t x, size_t y, size_t width, size_t height, const Random& random )
+    {
+        assert( x + width <= src.m_fieldW && y + height <= src.m_fieldH && "Wave::loadRegion() the region is out of the field" );
+
+        copySettings( src );
+        m_gaveUp = false;
+        m_backtracks = 0;
+        m_restarts = 0;
+        m_fieldW = width;
+        m_fieldH = height;
+        m_rndSeed = src.m_rndSeed;
+        m_random = random;
+
+        m_field.assign( width * height, m_rules->size(), false );
+        for ( size_t row = 0; row < height; ++row )
         {
-            if ( !m_visited[id] && !m_field[id].single() )
+            for ( size_t column = 0; column < width; ++column )
             {
-                wavefront.push( id );
+                storeCell( fieldIndex( column, row ), src.readCell( src.fieldIndex( x + column, y + row ) ) );
             }
-        };
+        }
 
-        const size_t x = id0 % m_fieldW;
-        const size_t y = id0 / m_fieldW;
+        m_visited.assign( width * height, 0 );
+        m_collapsed.assign( width * height, false );
+        m_wavefront.clear();
+        m_wavefrontHead = 0;
+        m_stepPending = false;
 
-        if ( y > 0 ) // Up
-        {
-            push( fieldIndex( x, y - 1 ) );
-        }
-        if ( y < m_fieldH - 1 ) // Down
+        initAdjacency();
+        rebuildIndex();
+
+        // the copied cells are already counted by src
+        resetStats();
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::copySettings( const Wave& src )
+    {
+        if ( m_rules != src.m_rules )
         {
-            push( fieldIndex( x, y + 1 ) );
+            m_rules = src.m_rules;
+            m_possibleNeighbors.assign( Directions, TileSet( m_rules->size() ) );
         }
-        if ( x > 0 ) // Left
+        m_propagation = src.m_propagation;
+        m_contradiction = src.m_contradiction;
+        m_maxBacktracks = src.m_maxBacktracks;
+        m_maxRestarts = src.m_maxRestarts;
+        m_field.setCompact( src.m_field.compact() );
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    size_t Wave<T, MaxTiles, Topology, Random>::fieldIndex( size_t x, size_t y ) const
+    {
+        return y * m_fieldW + x;
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::initRandom()
+    {
+        if ( !m_rndSeed )
         {
-            push( fieldIndex( x - 1, y ) );
+            std::random_device rd;
+            m_rndSeed = rd();
         }
-        if ( x < m_fieldW - 1 ) // Right
+        m_random.seed( m_rndSeed );
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::initField()
+    {
+        m_possibleNeighbors.assign( Directions, TileSet( m_rules->size() ) );
+        resetField();
+    }
+
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::resetField()
+    {
+        const size_t tiles = m_rules->size();
+
+        const size_t cells = m_fieldW * m_fieldH * m_fieldD;
+        m_field.assign( cells, tiles, true );
+        m_visited.assign( cells, 0 );
+        m_collapsed.assign( cells, false );
+        m_removals.clear();
+        m_wavefront.clear();
+        m_wavefrontHead = 0;
+        m_stepPending = false;
+        m_changes.clear();
+
+        // the next checkpoint is a full one
+        m_chain = 0;
+        m_dirty.reset( 0 );
+        m_entropy.track( false );
+
+        clearTrail();
+        m_gaveUp = false;
+        m_backtracks = 0;
+        m_restarts = 0;
+        resetStats();
+
+        m_entropy.reset( m_field.size(), tiles );
+        m_uncertaintyCurrent = m_field.size() * tiles;
+        m_indexDirty = false;
+
+        initAdjacency();
+        if ( m_propagation == Supports )
         {
-            push( fieldIndex( x + 1, y ) );
+            initSupports();
         }
     }
 
-    template<class T>
-    bool Wave<T>::isNeighbor(
-        const std::vector<T>& original,
-        const std::vector<T>& candidate,
-        Dir dir, size_t w, size_t h ) const
+    template<class T, size_t MaxTiles, class Topology, class Random>
+    void Wave<T, MaxTiles, Topology, Random>::initAdjacency()
     {
-        // some shenanigans to get the offsets in memory blocks
-        const size_t offset1 = dir % 2;
-        const size_t offset2 = 1 - offset1;
+        const size_t tiles = m_rules->size();
+        if ( m_propagation == Supports && tiles > UINT16_MAX )
+        {
+            // the counters would overflow, stick to the default method
+            m_propagation = Bitsets;
+        }
 
-        switch ( dir )
+        if ( m_propagation == Bitsets )
         {
-        case Up:
-        case Down: // compare the whole block, skipping one row 
-            return 0 == memcmp(
-                &original[offset1 * w],
-                &candidate[offset2 * w],
-                sizeof( T ) * w * (h - 1) );
+            std::vector<uint16_t>().swap( m_supports );
+            return;
+        }
 
-        case Left:
-        case Right: // line-by-line comparison, skipping one column
-            for ( size_t y = 0; y < h; ++y )
-            {
-                if ( 0 != memcmp(
-                    &original[y * w + offset1],
-                    &candidate[y * w + offset2],
-                    sizeof( T ) * (w - 1) ) )
-                {
-                    return false;
-                }
-            }
-            break;
+        m_rules->compileSupports();
+    }
+
+    template<class T, size_t MaxTiles>
+    ChunkGenerator<T, MaxTiles>::ChunkGenerator( typename WaveType::RuleSetPtr rules, size_t chunkWidth, size_t chunkHeight, size_t worldSeed )
+        : m_wave( chunkWidth, chunkHeight, std::move( rules ), 1 )
+        , m_worldSeed( worldSeed )
+    {
+        if ( !m_worldSeed )
+        {
+            std::random_device rd;
+            m_worldSeed = rd();
         }
+    }
 
-        return true;
+    template<class T, size_t MaxTiles>
+    void ChunkGenerator<T, MaxTiles>::setPropagation( typename WaveType::Propagation mode )
+    {
+        m_wave.setPropagation( mode );
     }
 
-    template<class T>
-    const Bitset& Wave<T>::getNeighbor( size_t x, size_t y, int dir ) const
+    template<class T, size_t MaxTiles>
+    void ChunkGenerator<T, MaxTiles>::setStorage( typename WaveType::Storage mode )
     {
-        switch ( dir )
+        m_wave.setStorage( mode );
+    }
+
+    template<class T, size_t MaxTiles>
+    void ChunkGenerator<T, MaxTiles>::setContradiction( typename WaveType::Contradiction mode, size_t maxBacktracks, size_t maxRestarts )
+    {
+        m_wave.setContradiction( mode, maxBacktracks, maxRestarts );
+    }
+
+    template<class T, size_t MaxTiles>
+    const typename ChunkGenerator<T, MaxTiles>::Chunk& ChunkGenerator<T, MaxTiles>::load( int32_t x, int32_t y )
+    {
+        auto found = m_chunks.find( key( x, y ) );
+        if ( found != m_chunks.end() )
         {
-        case Up:
-            if ( y > 0 )
-            {
-                return m_field[fieldIndex( x, y - 1 )];
-            }
-            break;
+            return found->second;
+        }
 
-        case Down:
-            if ( y < m_fieldH - 1 )
-            {
-                return m_field[fieldIndex( x, y + 1 )];
-            }
-            break;
+        const size_t w = getChunkWidth();
+        const size_t h = getChunkHeight();
 
-        case Left:
-            if ( x > 0 )
+        auto takeRow = [w]( const Chunk* chunk, size_t row, std::vector<uint32_t>& dst )
+        {
+            dst.clear();
+            if ( chunk )
             {
-                return m_field[fieldIndex( x - 1, y )];
+                dst.assign( chunk->begin() + row * w, chunk->begin() + (row + 1) * w );
             }
-            break;
-
-        case Right:
-            if ( x < m_fieldW - 1 )
+        };
+        auto takeColumn = [w, h]( const Chunk* chunk, size_t column, std::vector<uint32_t>& dst )
+        {
+            dst.clear();
+            for ( size_t i = 0; chunk && i < h; ++i )
             {
-                return m_field[fieldIndex( x + 1, y )];
+                dst.push_back( (*chunk)[i * w + column] );
             }
-            break;
-        }
+        };
 
-        return m_allTiles;
+        takeRow( find( x, y - 1 ), h - 1, m_borders.up );
+        takeRow( find( x, y + 1 ), 0, m_borders.down );
+        takeColumn( find( x - 1, y ), w - 1, m_borders.left );
+        takeColumn( find( x + 1, y ), 0, m_borders.right );
+
+        // the chunk's seed depends on its position only
+        const uint64_t position[3] = { static_cast<uint64_t>( m_worldSeed ), static_cast<uint64_t>( x ), static_cast<uint64_t>( y ) };
+        m_wave.reset( static_cast<size_t>( detail::hashBytes( position, sizeof( position ) ) ) | 1 );
+        m_wave.collapseChunk( m_borders );
+
+        Chunk& chunk = m_chunks[key( x, y )];
+        chunk.resize( w * h );
+        m_wave.writeTileIds( chunk.data() );
+
+        return chunk;
     }
 
-    template<class T>
-    typename Wave<T>::Dir Wave<T>::revDir( int dir ) const
+    template<class T, size_t MaxTiles>
+    const typename ChunkGenerator<T, MaxTiles>::Chunk* ChunkGenerator<T, MaxTiles>::find( int32_t x, int32_t y ) const
     {
-        switch ( dir )
-        {
-        case Up:
-            return Down;
-        case Down:
-            return Up;
-        case Left:
-            return Right;
-        case Right:
-            return Left;
-        }
-        return Up;
+        auto found = m_chunks.find( key( x, y ) );
+        return found != m_chunks.end() ? &found->second : nullptr;
     }
 
-    template<class T>
-    size_t Wave<T>::fieldIndex( size_t x, size_t y ) const
+    template<class T, size_t MaxTiles>
+    void ChunkGenerator<T, MaxTiles>::release( int32_t x, int32_t y )
     {
-        return y * m_fieldW + x;
+        m_chunks.erase( key( x, y ) );
     }
 
-    template<class T>
-    void Wave<T>::initRandom()
+    template<class T, size_t MaxTiles>
+    size_t ChunkGenerator<T, MaxTiles>::getLoadedCount() const
     {
-        if ( !m_seed.rndSeed )
-        {
-            std::random_device rd;
-            m_seed.rndSeed = rd();
-        }
-        m_mt = std::make_unique<std::mt19937_64>( m_seed.rndSeed );
+        return m_chunks.size();
     }
 
-    template<class T>
-    void Wave<T>::initField()
+    template<class T, size_t MaxTiles>
+    const std::vector<T>& ChunkGenerator<T, MaxTiles>::getTiles() const
     {
-        for ( int i = 0; i < 4; ++i )
-        {
-            m_possibleNeighbors.emplace_back( m_seed.tiles.size() );
-        }
-        m_allTiles = Bitset( m_seed.tiles.size(), true );
-        m_field.resize( m_fieldW * m_fieldH, Bitset( m_seed.tiles.size(), true ) );
-        m_visited.resize( m_fieldW * m_fieldH, false );
-        m_collapsed.resize( m_fieldW * m_fieldH, false );
+        return m_wave.getTiles();
+    }
+
+    template<class T, size_t MaxTiles>
+    size_t ChunkGenerator<T, MaxTiles>::getChunkWidth() const
+    {
+        return m_wave.getFieldWidth();
+    }
+
+    template<class T, size_t MaxTiles>
+    size_t ChunkGenerator<T, MaxTiles>::getChunkHeight() const
+    {
+        return m_wave.getFieldHeight();
+    }
+
+    template<class T, size_t MaxTiles>
+    uint64_t ChunkGenerator<T, MaxTiles>::key( int32_t x, int32_t y )
+    {
+        return (static_cast<uint64_t>( static_cast<uint32_t>( x ) ) << 32) | static_cast<uint32_t>( y );
     }
 }
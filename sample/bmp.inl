@@ -1,4 +1,5 @@
-// very lame implementation of .bmp format reader/writer
+// very lame implementation of .bmp format reader/writer, 24-bpp uncompressed images only.
+// The images are kept top-down in memory, the rows of the file are bottom-up unless the height is negative
 
 struct Color
 {
@@ -10,58 +11,133 @@ struct Color
     unsigned char r, g, b;
 };
 
-std::vector<Color> readBMP( std::string filename, uint32_t& w, uint32_t& h )
+static const uint32_t BMPHeaderSize = 54;
+
+// the rows are padded to 4 bytes
+inline size_t bmpRowSize( uint32_t w )
 {
-    std::ifstream file( filename.c_str() );
-    {
-        char header[54];
-        file.read( header, 54 );
+    return (static_cast<size_t>( w ) * 3 + 3) & ~static_cast<size_t>( 3 );
+}
+
+inline void bmpHeader( uint32_t w, uint32_t h, char* out )
+{
+    const uint32_t pixels = static_cast<uint32_t>( bmpRowSize( w ) * h );
+    const uint32_t headers[13] = { pixels + BMPHeaderSize, 0, BMPHeaderSize, 40, w, h, 0x180001, 0, pixels, 0, 0, 0, 0 };
+
+    out[0] = 'B';
+    out[1] = 'M';
+    memcpy( out + 2, headers, sizeof( headers ) );
+}
 
-        w = *reinterpret_cast<uint32_t*>( &header[18] );
-        h = *reinterpret_cast<uint32_t*>( &header[22] );
+// the file is mapped into memory, nothing is read but the pixels needed. Returns an empty image on errors
+std::vector<Color> readBMP( const std::string& filename, uint32_t& w, uint32_t& h )
+{
+    w = 0;
+    h = 0;
+
+    size_t size = 0;
+    const auto file = c011apsy::mapFile( filename, size );
+    if ( !file || size < BMPHeaderSize )
+    {
+        return {};
     }
 
-    const uint32_t rowLen = w * 3 + (4 - ((w * 3) % 4)) % 4;
-    const uint32_t size = 3 * rowLen * h;
-    char* data = new char[size];
+    const unsigned char* data = static_cast<const unsigned char*>( file.get() );
+    auto read32 = [data]( size_t offset )
+    {
+        uint32_t value;
+        memcpy( &value, data + offset, sizeof( value ) );
+        return value;
+    };
 
-    file.read( data, size );
+    const uint32_t offset = read32( 10 );
+    const int32_t width = static_cast<int32_t>( read32( 18 ) );
+    const int32_t height = static_cast<int32_t>( read32( 22 ) );
+    const uint32_t bpp = read32( 26 ) >> 16;
+    const uint32_t compression = read32( 30 );
+    if ( data[0] != 'B' || data[1] != 'M' || bpp != 24 || compression != 0 || width <= 0 || height == 0 || height == INT32_MIN )
+    {
+        return {};
+    }
 
-    std::vector<Color> result( w * h );
+    const uint32_t rows = static_cast<uint32_t>( height < 0 ? -height : height );
+    const size_t rowSize = bmpRowSize( static_cast<uint32_t>( width ) );
+    if ( offset > size || (size - offset) / rowSize < rows )
+    {
+        return {};
+    }
+
+    w = static_cast<uint32_t>( width );
+    h = rows;
 
+    std::vector<Color> result( static_cast<size_t>( w ) * h );
     for ( uint32_t row = 0; row < h; ++row )
     {
-        const uint32_t dataId = row * rowLen;
-        const uint32_t resId = row * w;
-        memcpy( &result[resId], &data[dataId], w * 3 );
+        const size_t fileRow = height > 0 ? h - 1 - row : row;
+        memcpy( &result[static_cast<size_t>( row ) * w], data + offset + fileRow * rowSize, static_cast<size_t>( w ) * 3 );
     }
 
-    delete[] data;
     return result;
 }
 
+// the whole file is put together in memory and written at once
 bool writeBMP( const std::vector<Color>& data, uint32_t w, std::string filename )
 {
-    std::ofstream file( filename );
-    if ( !file )
+    const uint32_t h = static_cast<uint32_t>( data.size() / w );
+    const size_t rowSize = bmpRowSize( w );
+
+    std::vector<char> buffer( BMPHeaderSize + rowSize * h, 0 );
+    bmpHeader( w, h, buffer.data() );
+    for ( uint32_t row = 0; row < h; ++row )
     {
-        return false;
+        memcpy( &buffer[BMPHeaderSize + (h - 1 - row) * rowSize], &data[static_cast<size_t>( row ) * w], static_cast<size_t>( w ) * 3 );
     }
 
-    const uint32_t h = static_cast<uint32_t>( data.size() ) / w;
-    const uint32_t padding = (4 - ((w * 3) % 4)) % 4;
-    const uint32_t paddedsize = ((w * 3) + padding) * h;
+    std::ofstream file( filename, std::ios::binary );
+    return file && file.write( buffer.data(), buffer.size() );
+}
 
-    uint32_t headers[13] = { paddedsize + 54, 0, 54, 40, w, h, 0x180001, 0, paddedsize, 0, 0, 0, 0 };
+// writes the rows of an image as soon as they're ready, in any order
+class BMPStream
+{
+public:
+    bool open( const std::string& filename, uint32_t w, uint32_t h )
+    {
+        m_file.open( filename, std::ios::binary );
+        m_w = w;
+        m_h = h;
+        m_row.assign( bmpRowSize( w ), 0 );
 
-    file.write( "BM", 2 );
-    file.write( reinterpret_cast<char*>( headers ), 13 * sizeof( uint32_t ) );
+        // the file gets its full size right away, the rows are written in place
+        char header[BMPHeaderSize];
+        bmpHeader( w, h, header );
+        m_file.write( header, BMPHeaderSize );
+        if ( h )
+        {
+            m_file.seekp( static_cast<std::streamoff>( BMPHeaderSize + m_row.size() * h - 1 ) );
+            m_file.put( 0 );
+        }
+        return !!m_file;
+    }
 
-    for ( size_t i = 0; i < h; ++i )
+    // y goes top-down, same as the rows in memory
+    bool writeRow( uint32_t y, const Color* row )
     {
-        file.write( reinterpret_cast<const char*>( &data[i * w] ), w * 3 );
-        file.write( "\0\0\0", padding );
+        memcpy( m_row.data(), row, static_cast<size_t>( m_w ) * 3 );
+        m_file.seekp( static_cast<std::streamoff>( BMPHeaderSize + (m_h - 1 - y) * m_row.size() ) );
+        m_file.write( m_row.data(), m_row.size() );
+        return !!m_file;
     }
 
-    return !!file;
-}
+    bool close()
+    {
+        m_file.close();
+        return !m_file.fail();
+    }
+
+private:
+    std::ofstream m_file;
+    uint32_t m_w = 0;
+    uint32_t m_h = 0;
+    std::vector<char> m_row; /// a padded row
+};
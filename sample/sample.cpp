@@ -1,8 +1,13 @@
 #include <chrono>
+#include <condition_variable>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <fstream>
 #include <iostream>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "../include/c011apsy.hpp"
@@ -14,7 +19,7 @@ void printUsage()
 {
     std::cout << "c011apsy sample" << std::endl;
     std::cout << "Usage:" << std::endl;
-    std::cout << "sample SEED WIN_WIDTH WIN_HEIGHT DST WIDTH HEIGHT [rnd]" << std::endl;
+    std::cout << "sample SEED WIN_WIDTH WIN_HEIGHT DST WIDTH HEIGHT [rnd] [--stream]" << std::endl;
     std::cout << "\tSEED - path to the seed image file (24-bpp .bmp)" << std::endl;
     std::cout << "\tWIN_WIDTH" << std::endl;
     std::cout << "\tWIN_HEIGHT - width and height, in pixels, of a local similarity area (tile size)" << std::endl;
@@ -22,6 +27,7 @@ void printUsage()
     std::cout << "\tWIDTH" << std::endl;
     std::cout << "\tHEIGHT - desired result size, in pixels" << std::endl;
     std::cout << "\trnd - an integer value used to seed the random generator (optional)" << std::endl;
+    std::cout << "\t--stream - save the rows of the result while it's still being generated (optional)" << std::endl;
 }
 
 struct Args
@@ -33,26 +39,41 @@ struct Args
     uint32_t resW = 0;
     uint32_t resH = 0;
     uint32_t rndSeed = 0;
+    bool stream = false;
 };
 
 bool parseArgs( int argc, char* argv[], Args& args )
 {
-    if ( argc < 7 )
+    // the flags may go anywhere, the rest of the args are positional
+    std::vector<const char*> values;
+    for ( int i = 1; i < argc; ++i )
+    {
+        if ( std::strcmp( argv[i], "--stream" ) == 0 )
+        {
+            args.stream = true;
+        }
+        else
+        {
+            values.push_back( argv[i] );
+        }
+    }
+
+    if ( values.size() < 6 )
     {
         return false;
     }
 
-    args.src = argv[1];
-    args.winW = std::atoi( argv[2] );
-    args.winH = std::atoi( argv[3] );
-    args.dst = argv[4];
-    args.resW = std::atoi( argv[5] );
-    args.resH = std::atoi( argv[6] );
+    args.src = values[0];
+    args.winW = std::atoi( values[1] );
+    args.winH = std::atoi( values[2] );
+    args.dst = values[3];
+    args.resW = std::atoi( values[4] );
+    args.resH = std::atoi( values[5] );
 
     args.rndSeed = 0;
-    if ( argc > 7 )
+    if ( values.size() > 6 )
     {
-        args.rndSeed = std::atoi( argv[7] );
+        args.rndSeed = std::atoi( values[6] );
     }
 
     return true;
@@ -60,23 +81,144 @@ bool parseArgs( int argc, char* argv[], Args& args )
 
 bool saveResult( Wave<Color>& wave, std::string path )
 {
-    const auto& tiles = wave.getTiles();
-    const auto& field = wave.getField();
-
-    std::vector<Color> result;
-    result.reserve( field.size() );
+    std::vector<Color> result( wave.getFieldWidth() * wave.getFieldHeight() );
 
     // after the generation is done, each field cell contains only a single bit set to true.
     // the position of the said bit is the id of the tile that should be placed in this cell
     // note: tile is represented by a single value (topleft corner), so in this case
     // we have the 1-to-1 relationship between the tile and the pixel color
-    for ( const auto& cell : field )
+    wave.writeResult( result.data() );
+
+    return writeBMP( result, static_cast<uint32_t>( wave.getFieldWidth() ), path );
+}
+
+// the wave is collapsed here, and the rows are saved on another thread as soon as all their cells are solved,
+// so most of the file is written by the time the generation is done
+bool collapseStreaming( Wave<Color>& wave, const std::string& path )
+{
+    const uint32_t w = static_cast<uint32_t>( wave.getFieldWidth() );
+    const uint32_t h = static_cast<uint32_t>( wave.getFieldHeight() );
+
+    BMPStream stream;
+    if ( !stream.open( path, w, h ) )
     {
-        size_t tileId = cell.first();
-        result.push_back( tiles[tileId] );
+        return false;
     }
 
-    return writeBMP( result, static_cast<uint32_t>( wave.getFieldWidth() ), path );
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<std::pair<uint32_t, std::vector<Color>>> rows;
+    bool finished = false;
+    bool written = true;
+
+    std::thread writer( [&]()
+    {
+        std::unique_lock<std::mutex> lock( mutex );
+        for ( ;; )
+        {
+            ready.wait( lock, [&]() { return finished || !rows.empty(); } );
+            if ( rows.empty() )
+            {
+                break;
+            }
+
+            auto row = std::move( rows.front() );
+            rows.pop_front();
+
+            lock.unlock();
+            written = stream.writeRow( row.first, row.second.data() ) && written;
+            lock.lock();
+        }
+    } );
+
+    // the solved cells are written here by the wave, the journal tells which ones they are.
+    // The rows are copied for the writer, so the wave never writes to the memory that's being saved
+    std::vector<Color> result( static_cast<size_t>( w ) * h );
+    std::vector<char> solved( result.size(), 0 );
+    std::vector<uint32_t> rowSolved( h, 0 );
+    std::vector<char> rowQueued( h, 0 );
+    std::vector<Wave<Color>::Change> changes;
+
+    // the cells solved before the start are never logged. The const field keeps the index as it is
+    const Wave<Color>::Field& field = static_cast<const Wave<Color>&>( wave ).getField();
+    wave.writeResult( result.data() );
+    for ( size_t id = 0; id < result.size(); ++id )
+    {
+        solved[id] = field[id].count() == 1;
+        rowSolved[id / w] += solved[id];
+    }
+
+    wave.setOutput( result.data() );
+    wave.setJournal( true );
+
+    auto queueRow = [&]( uint32_t y )
+    {
+        rowQueued[y] = 1;
+        std::vector<Color> row( result.begin() + static_cast<size_t>( y ) * w, result.begin() + static_cast<size_t>( y + 1 ) * w );
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            rows.emplace_back( y, std::move( row ) );
+        }
+        ready.notify_one();
+    };
+
+    bool done = false;
+    while ( !done )
+    {
+        done = wave.collapseFor( std::chrono::milliseconds( 10 ) );
+
+        wave.takeChanges( changes );
+        for ( const auto& change : changes )
+        {
+            // a solved cell may be undone by the backtracking, its row is saved again later
+            const char isSolved = change.count == 1;
+            if ( solved[change.cell] != isSolved )
+            {
+                const uint32_t y = change.cell / w;
+                solved[change.cell] = isSolved;
+                if ( isSolved )
+                {
+                    ++rowSolved[y];
+                }
+                else
+                {
+                    --rowSolved[y];
+                    rowQueued[y] = 0;
+                }
+            }
+        }
+        for ( const auto& change : changes )
+        {
+            const uint32_t y = change.cell / w;
+            if ( rowSolved[y] == w && !rowQueued[y] )
+            {
+                queueRow( y );
+            }
+        }
+
+        std::cout << "Generating: " << wave.getProgress() << "%     \r";
+    }
+
+    // the contradictions may leave some cells unsolved, these rows are saved as they are
+    for ( uint32_t y = 0; y < h; ++y )
+    {
+        if ( !rowQueued[y] )
+        {
+            queueRow( y );
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        finished = true;
+    }
+    ready.notify_one();
+    writer.join();
+
+    wave.setOutput( nullptr );
+    wave.setJournal( false );
+
+    return stream.close() && written;
 }
 
 void callback( Wave<Color>& wave, size_t x, size_t y )
@@ -99,14 +241,22 @@ int main( int argc, char* argv[] )
     uint32_t seedW;
     uint32_t seedH;
     auto seed = readBMP( args.src, seedW, seedH );
+    if ( seed.empty() )
+    {
+        std::cout << "Couldn't read the seed, it should be a 24-bpp uncompressed .bmp" << std::endl;
+        return 0;
+    }
 
-    using clock = std::chrono::system_clock;
+    using clock = std::chrono::steady_clock;
     using msec = std::chrono::duration<double, std::milli>;
     auto before = clock::now();
 
     // create a wave with the specified dimensions
     Wave<Color> wave( args.resW, args.resH );
 
+    // use all the available cores for the initialization
+    wave.setThreads( 0 );
+
     std::cout << "Generating tiles..." << std::endl;
 
     // initialize the wave with the given pattern
@@ -115,34 +265,65 @@ int main( int argc, char* argv[] )
     msec duration = clock::now() - before;
 
     std::cout << wave.getTiles().size() << " tiles were generated. It took " << duration.count() << " ms" << std::endl;
+
+    const auto& report = wave.getInitReport();
+    std::cout << "\t" << report.samples << " samples scanned in " << report.extraction.count() << " ms" << std::endl;
+    std::cout << "\t" << report.comparisons << " tile pairs compared, "
+        << report.neighbors << " neighbors found in " << report.adjacency.count() << " ms" << std::endl;
+
     std::cout << "Generating result..." << std::endl;
 
     // start the wave collapse
     before = clock::now();
 
+    bool saved = false;
+    if ( args.stream )
+    {
+        // the file is written while the wave is being collapsed
+        saved = collapseStreaming( wave, args.dst );
+    }
+    else
+    {
 #if 1
-    // algorithm will stop when the whole field is solved.
-    // keep in mind the callback will be called for every processed point
-    // and it could slow the generation process SIGNIFICANTLY.
-    // So, don't provide a callback if you do not strictly need the realtime algorithm info
+        // algorithm will stop when the whole field is solved.
+        // keep in mind the callback will be called for every processed point
+        // and it could slow the generation process SIGNIFICANTLY.
+        // So, don't provide a callback if you do not strictly need the realtime algorithm info
 
-    wave.collapse( false/*, callback*/ );
+        wave.collapse( false/*, callback*/ );
 #else
-    // Alternative variant, alogrithm will yield after every wave.
-    // You may still provide a callback to get the finer information about the generation state
+        // Alternative variant, alogrithm will yield after every wave.
+        // You may still provide a callback to get the finer information about the generation state
     
-    while ( !wave.collapse( true/*, callback*/ ) )
-    {
-        std::cout << "Generating: " << wave.getProgress() << "%     \r";
-    }
+        while ( !wave.collapse( true/*, callback*/ ) )
+        {
+            std::cout << "Generating: " << wave.getProgress() << "%     \r";
+        }
 #endif
+    }
 
     duration = clock::now() - before;
 
     std::cout << std::endl;
     std::cout << "Generation took " << duration.count() << " ms" << std::endl;
 
-    if ( !saveResult( wave, args.dst ) )
+    if ( Wave<Color>::StatsEnabled )
+    {
+        const auto stats = wave.getStats();
+        std::cout << "\t" << stats.collapses << " collapses, " << stats.pops << " propagation pops, "
+            << stats.filters << " filterCandidates() calls, " << stats.bitsRemoved << " tiles removed" << std::endl;
+        std::cout << "\t" << stats.contradictions << " contradictions, the longest wavefront is " << stats.peakWavefront
+            << ", " << stats.bytes / 1024 << " Kb used" << std::endl;
+        std::cout << "\t" << stats.selection.count() << " ms selecting the cells, "
+            << stats.propagation.count() << " ms propagating" << std::endl;
+    }
+
+    if ( !args.stream )
+    {
+        saved = saveResult( wave, args.dst );
+    }
+
+    if ( !saved )
     {
         std::cout << "Oops. Couldn't save the result. Check the args maybe?" << std::endl;
     }
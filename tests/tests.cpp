@@ -0,0 +1,246 @@
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../include/c011apsy.hpp"
+#include "../sample/bmp.inl"
+
+// the solver state machines checked end to end: backtracking, checkpoints, compact storage, parallel collapse.
+// No framework, the failures are printed and counted, run it with ctest
+
+using namespace c011apsy;
+
+namespace
+{
+    using ColorWave = Wave<Color>;
+
+    size_t failures = 0;
+
+    void check( bool condition, const std::string& what )
+    {
+        if ( !condition )
+        {
+            std::cout << "FAILED: " << what << std::endl;
+            ++failures;
+        }
+    }
+
+    ColorWave::RuleSetPtr loadRules( const char* image, size_t tileSize )
+    {
+        uint32_t w = 0;
+        uint32_t h = 0;
+        const auto pattern = readBMP( std::string( C011APSY_IMG_DIR ) + "/" + image, w, h );
+        if ( pattern.empty() )
+        {
+            return nullptr;
+        }
+        return std::make_shared<const ColorWave::RuleSet>( pattern, w, h, tileSize, tileSize );
+    }
+
+    std::vector<uint32_t> tileIds( const ColorWave& wave )
+    {
+        std::vector<uint32_t> ids( wave.getFieldWidth() * wave.getFieldHeight() );
+        wave.writeTileIds( ids.data() );
+        return ids;
+    }
+
+    bool solved( const ColorWave& wave )
+    {
+        for ( const auto& cell : wave.getField() )
+        {
+            if ( cell.count() != 1 )
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /*
+    * The number of neighbor pairs breaking the rules, each pair is counted once
+    */
+    size_t violations( const ColorWave& wave )
+    {
+        const auto& rules = *wave.getRules();
+        const size_t w = wave.getFieldWidth();
+        const size_t h = wave.getFieldHeight();
+        const auto ids = tileIds( wave );
+
+        size_t bad = 0;
+        for ( size_t y = 0; y < h; ++y )
+        {
+            for ( size_t x = 0; x < w; ++x )
+            {
+                const uint32_t tile = ids[y * w + x];
+                if ( x + 1 < w && !rules.getNeighbors( tile, ColorWave::Right )[ids[y * w + x + 1]] )
+                {
+                    ++bad;
+                }
+                if ( y + 1 < h && !rules.getNeighbors( tile, ColorWave::Down )[ids[(y + 1) * w + x]] )
+                {
+                    ++bad;
+                }
+            }
+        }
+        return bad;
+    }
+
+    std::string name( ColorWave::Propagation propagation, size_t seed )
+    {
+        return std::string( propagation == ColorWave::Supports ? "Supports" : "Bitsets" ) + ", seed " + std::to_string( seed );
+    }
+
+    void testBacktrack( const ColorWave::RuleSetPtr& rules, ColorWave::Propagation propagation, size_t seed )
+    {
+        ColorWave wave( 48, 48 );
+        wave.setPropagation( propagation );
+        wave.setContradiction( ColorWave::Backtrack, 256, 32 );
+        wave.init( rules, seed );
+        wave.collapse( false );
+
+        check( solved( wave ), "backtrack: the field is not solved, " + name( propagation, seed ) );
+        check( violations( wave ) == 0, "backtrack: the rules are broken, " + name( propagation, seed ) );
+    }
+
+    void testCheckpoint( const ColorWave::RuleSetPtr& rules, ColorWave::Propagation propagation, size_t seed )
+    {
+        ColorWave wave( 40, 40 );
+        wave.setPropagation( propagation );
+        wave.setContradiction( ColorWave::Backtrack );
+        wave.init( rules, seed );
+
+        // a full checkpoint and a chain of the incremental ones, taken in the middle of the collapse
+        std::vector<std::vector<uint8_t>> chain;
+        for ( size_t i = 0; i < 3; ++i )
+        {
+            for ( size_t step = 0; step < 40; ++step )
+            {
+                wave.collapse( true );
+            }
+            chain.push_back( wave.checkpoint( i > 0 ) );
+        }
+        wave.collapse( false );
+        const auto expected = tileIds( wave );
+
+        ColorWave full( 40, 40 );
+        full.setPropagation( propagation );
+        full.setContradiction( ColorWave::Backtrack );
+        full.init( rules, seed + 1 );
+        check( full.restore( chain.front().data(), chain.front().size() ), "checkpoint: the full one is refused, " + name( propagation, seed ) );
+        full.collapse( false );
+        check( tileIds( full ) == expected, "checkpoint: the restored full one gives another result, " + name( propagation, seed ) );
+
+        ColorWave incremental( 40, 40 );
+        incremental.setPropagation( propagation );
+        incremental.setContradiction( ColorWave::Backtrack );
+        incremental.init( rules, seed + 2 );
+        bool restored = true;
+        for ( const auto& data : chain )
+        {
+            restored = incremental.restore( data.data(), data.size() ) && restored;
+        }
+        check( restored, "checkpoint: the chain is refused, " + name( propagation, seed ) );
+
+        incremental.collapse( false );
+        check( tileIds( incremental ) == expected, "checkpoint: the restored chain gives another result, " + name( propagation, seed ) );
+
+        ColorWave last( 40, 40 );
+        last.setPropagation( propagation );
+        last.setContradiction( ColorWave::Backtrack );
+        last.init( rules, seed + 3 );
+        last.restore( chain.front().data(), chain.front().size() );
+        const auto& latest = chain.back();
+        check( !last.restore( latest.data(), latest.size() ), "checkpoint: an incremental one is accepted out of order, " + name( propagation, seed ) );
+
+        // a full checkpoint taken at the very end of the chain continues the same way
+        ColorWave again( 40, 40 );
+        again.setPropagation( propagation );
+        again.setContradiction( ColorWave::Backtrack );
+        again.init( rules, seed );
+        for ( size_t step = 0; step < 120; ++step )
+        {
+            again.collapse( true );
+        }
+        const auto snapshot = again.checkpoint();
+        ColorWave copy( 40, 40 );
+        copy.setPropagation( propagation );
+        copy.setContradiction( ColorWave::Backtrack );
+        copy.init( rules, seed + 4 );
+        check( copy.restore( snapshot.data(), snapshot.size() ), "checkpoint: refused, " + name( propagation, seed ) );
+        copy.collapse( false );
+        again.collapse( false );
+        check( tileIds( copy ) == tileIds( again ), "checkpoint: the restored wave gives another result, " + name( propagation, seed ) );
+        check( tileIds( again ) == expected, "checkpoint: taking the checkpoints changes the result, " + name( propagation, seed ) );
+    }
+
+    void testCompact( const ColorWave::RuleSetPtr& rules, ColorWave::Propagation propagation, ColorWave::Contradiction contradiction, size_t seed )
+    {
+        std::vector<uint32_t> results[2];
+        for ( int storage = 0; storage < 2; ++storage )
+        {
+            ColorWave wave( 64, 64 );
+            wave.setPropagation( propagation );
+            wave.setContradiction( contradiction );
+            wave.setStorage( storage ? ColorWave::Compact : ColorWave::Dense );
+            wave.init( rules, seed );
+            wave.collapse( false );
+            results[storage] = tileIds( wave );
+        }
+        check( results[0] == results[1], "compact: the result differs from the dense one, " + name( propagation, seed ) );
+    }
+
+    void testParallel( const ColorWave::RuleSetPtr& rules, ColorWave::Propagation propagation, size_t seed )
+    {
+        std::vector<uint32_t> results[2];
+        for ( int run = 0; run < 2; ++run )
+        {
+            ColorWave wave( 96, 80 );
+            wave.setPropagation( propagation );
+            wave.setContradiction( ColorWave::Backtrack, 256, 32 );
+            wave.setThreads( run ? 3 : 1 );
+            wave.init( rules, seed );
+            wave.collapseParallel( 24 );
+
+            check( solved( wave ), "parallel: the field is not solved, " + name( propagation, seed ) );
+            check( violations( wave ) == 0, "parallel: the rules are broken, " + name( propagation, seed ) );
+            results[run] = tileIds( wave );
+        }
+        check( results[0] == results[1], "parallel: the result depends on the number of threads, " + name( propagation, seed ) );
+    }
+}
+
+int main()
+{
+    const char* const images[] = { "pipes.bmp", "maze.bmp" };
+    const ColorWave::Propagation propagations[] = { ColorWave::Bitsets, ColorWave::Supports };
+
+    for ( const char* image : images )
+    {
+        const auto rules = loadRules( image, 3 );
+        check( rules != nullptr, std::string( "couldn't load " ) + image );
+        if ( !rules )
+        {
+            continue;
+        }
+
+        for ( const auto propagation : propagations )
+        {
+            for ( size_t seed = 1; seed <= 4; ++seed )
+            {
+                testBacktrack( rules, propagation, seed );
+                testCompact( rules, propagation, ColorWave::Fallback, seed );
+                testCompact( rules, propagation, ColorWave::Backtrack, seed );
+            }
+            for ( size_t seed = 1; seed <= 2; ++seed )
+            {
+                testCheckpoint( rules, propagation, seed );
+                testParallel( rules, propagation, seed );
+            }
+        }
+    }
+
+    std::cout << (failures ? std::to_string( failures ) + " checks failed" : std::string( "all checks passed" )) << std::endl;
+    return failures ? 1 : 0;
+}